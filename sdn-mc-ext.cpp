@@ -15,13 +15,24 @@
 // CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 //
 
-#include <cstdlib>
+#include <algorithm>
 #include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <regex>
 #include <string>
 #include <unordered_map>
 #include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBMAGIC
+#include <magic.h>
+#endif
 
 // Trailing return types make C++ syntax suck considerably less
 #define fun static auto
@@ -39,8 +50,423 @@ fun shell_escape (const string &v) -> string {
     return "'" + regex_replace (v, regex {"'"}, "'\\''") + "'";
 }
 
+// --- File types --------------------------------------------------------------
+
+/// Describe common kinds of text the way file(1) does, or return nothing
+/// if it would say something more specific
+fun sniff_text (const string &head) -> string {
+	bool ascii = true;
+	for (size_t i = 0; i < head.length (); i++) {
+		auto c = (unsigned char) head[i];
+		if (c < 0x80) {
+			if (c < 0x20 && (!c || !strchr ("\a\b\t\n\v\f\r\x1b", c)))
+				return "";
+			continue;
+		}
+
+		// Sequences cut off by the end of the buffer are given the benefit
+		// of the doubt
+		ascii = false;
+		size_t length = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 0;
+		if (!length || c > 0xf4)
+			return "";
+		for (size_t k = 1; k < length && i + 1 < head.length (); k++)
+			if ((head[++i] & 0xc0) != 0x80)
+				return "";
+	}
+
+	// Scripts, markup, and source code get their own descriptions
+	auto first = head.find_first_not_of (" \t\r\n");
+	if (first != head.npos && strchr (".<#'\\%{[/", head[first]))
+		return "";
+	return ascii ? "ASCII text" : "Unicode text, UTF-8 text";
+}
+
+/// Recognize some common file formats from their first few kilobytes,
+/// returning nothing when unsure, or when file(1) would look inside
+fun sniff (const string &head) -> string {
+	auto at = [&](size_t offset, const char *magic, size_t length) {
+		return head.length () >= offset + length
+			&& !head.compare (offset, length, magic, length);
+	};
+	auto is = [&](const char *magic, size_t length) {
+		return at (0, magic, length);
+	};
+
+	if (is ("\x7f" "ELF", 4) && head.length () >= 18) {
+		bool msb = head[5] == 2;
+		auto type = (unsigned char) head[msb ? 17 : 16];
+		const char *types[] = {"no file type", "relocatable", "executable",
+			"shared object", "core file"};
+		return string ("ELF ") + (head[4] == 2 ? "64-bit" : "32-bit")
+			+ (msb ? " MSB " : " LSB ") + (type < 5 ? types[type] : "");
+	}
+
+	// Compressed data is described together with its decompressed contents
+	if (is ("\x1f\x8b", 2) || is ("BZh", 3) || is ("\xfd" "7zXZ", 6)
+	 || is ("\x28\xb5\x2f\xfd", 4) || is ("\x5d\0\0", 3) || is ("\x1f\x9d", 2)
+	 || is ("PK\x03\x04", 4))
+		return "";
+
+	if (is ("\x89PNG\r\n\x1a\n", 8))
+		return "PNG image data";
+	if (is ("\xff\xd8\xff", 3))
+		return "JPEG image data";
+	if (is ("GIF87a", 6) || is ("GIF89a", 6))
+		return "GIF image data, version " + head.substr (3, 3);
+	if (is ("II*\0", 4))
+		return "TIFF image data, little-endian";
+	if (is ("MM\0*", 4))
+		return "TIFF image data, big-endian";
+	if (is ("RIFF", 4) && at (8, "WEBP", 4))
+		return "RIFF (little-endian) data, Web/P image";
+	if (is ("RIFF", 4) && at (8, "WAVE", 4))
+		return "RIFF (little-endian) data, WAVE audio";
+	if (is ("RIFF", 4) && at (8, "AVI ", 4))
+		return "RIFF (little-endian) data, AVI";
+	if (at (4, "ftyp", 4))
+		return "ISO Media";
+	if (is ("\x1a\x45\xdf\xa3", 4))
+		return "Matroska data";
+	if (is ("OggS", 4))
+		return "Ogg data";
+	if (is ("fLaC", 4))
+		return "FLAC audio bitstream data";
+	if (is ("ID3", 3))
+		return "Audio file with ID3 version 2";
+
+	if (is ("%PDF-", 5))
+		return "PDF document, version " +
+			head.substr (5, head.find_first_not_of ("0123456789.", 5) - 5);
+	if (is ("%!PS", 4))
+		return "PostScript document text";
+	if (is ("SQLite format 3", 16))
+		return "SQLite 3.x database";
+
+	if (at (257, "ustar  \0", 8))
+		return "POSIX tar archive (GNU)";
+	if (at (257, "ustar\0", 6))
+		return "POSIX tar archive";
+	if (is ("7z\xbc\xaf\x27\x1c", 6))
+		return "7-zip archive data";
+	if (is ("Rar!\x1a\x07", 6))
+		return "RAR archive data";
+	if (is ("!<arch>\ndebian", 14))
+		return "Debian binary package";
+	if (is ("!<arch>\n", 8))
+		return "current ar archive";
+	return sniff_text (head);
+}
+
+fun run_file (const string &path) -> string;
+
+/// Describe a file like `file -Lbz` does, preferably without running it
+fun file_type (const string &path) -> string {
+	struct stat info = {};
+	if (stat (path.c_str (), &info))
+		return "";
+	if (S_ISDIR (info.st_mode))
+		return "directory";
+	if (S_ISFIFO (info.st_mode))
+		return "fifo (named pipe)";
+	if (S_ISSOCK (info.st_mode))
+		return "socket";
+	if (S_ISCHR (info.st_mode))
+		return "character special";
+	if (S_ISBLK (info.st_mode))
+		return "block special";
+	if (!info.st_size)
+		return "empty";
+
+	string head (4096, 0);
+	int fd = open (path.c_str (), O_RDONLY | O_CLOEXEC);
+	ssize_t length = fd < 0 ? -1 : read (fd, &head[0], head.size ());
+	if (fd >= 0)
+		close (fd);
+	if (length < 0)
+		return "";
+
+	head.resize (length);
+	if (auto type = sniff (head); !type.empty ())
+		return type;
+	return run_file (path);
+}
+
+#ifdef HAVE_LIBMAGIC
+
+fun run_file (const string &path) -> string {
+	// The database takes a while to load, so the server keeps it around
+	static auto cookie = magic_open (MAGIC_SYMLINK | MAGIC_COMPRESS);
+	static bool loaded = cookie && !magic_load (cookie, nullptr);
+	auto type = loaded ? magic_file (cookie, path.c_str ()) : nullptr;
+	return type ? type : "";
+}
+
+#else  // ! HAVE_LIBMAGIC
+
+fun run_file (const string &path) -> string {
+	string result;
+	auto command = "file -Lbz -- " + shell_escape (path);
+	if (auto fp = popen (command.c_str (), "r")) {
+		char buf[BUFSIZ];
+		while (fgets (buf, sizeof buf, fp))
+			result += buf;
+		pclose (fp);
+	}
+	if (!result.empty () && result.back () == '\n')
+		result.pop_back ();
+	return result;
+}
+
+#endif  // ! HAVE_LIBMAGIC
+
+/// Like basename(1), without modifying its argument
+fun path_basename (string path) -> string {
+	while (path.length () > 1 && path.back () == '/')
+		path.pop_back ();
+	auto slash = path.find_last_of ('/');
+	return slash == path.npos || path == "/" ? path : path.substr (slash + 1);
+}
+
+/// Like dirname(1), for normalized absolute paths
+fun path_dirname (const string &path) -> string {
+	auto slash = path.find_last_of ('/');
+	if (slash == path.npos)
+		return ".";
+	return slash ? path.substr (0, slash) : "/";
+}
+
+// --- Configuration -----------------------------------------------------------
+
 string arg_type, arg_path, arg_basename, arg_dirname, arg_verb;
-unordered_map<string, unordered_map<string, string>> sections;
+
+/// A section of mc.ext.ini, with any Include already merged into it
+struct rule {
+	string name;                        ///< Section name, for debugging
+	unordered_map<string, string> keys; ///< Key-value pairs
+};
+
+/// The configuration, made quick to match against
+struct ruleset {
+	vector<rule> rules;                 ///< Matchable sections, in order
+	rule fallback;                      ///< The Default section
+
+	// Indexes into rules, by Shell values, lowercased where appropriate
+	unordered_map<string, vector<size_t>> names, names_icase;
+	unordered_map<string, vector<size_t>> suffixes, suffixes_icase;
+	vector<size_t> unindexed;           ///< Rules without Shell, or with Regex
+};
+
+fun parse (istream &in) -> ruleset {
+	unordered_map<string, unordered_map<string, string>> sections;
+	string line, section;
+	vector<string> order;
+	regex re_entry {R"(^([-\w]+) *= *(.*)$)"};
+	smatch m;
+	while (getline (in, line)) {
+		if (line.empty () || line[0] == '#') {
+			continue;
+		} else if (auto length = line.length();
+			line.find_last_of ('[') == 0 &&
+			line.find_first_of (']') == length - 1) {
+			order.push_back ((section = line.substr (1, length - 2)));
+		} else if (regex_match (line, m, re_entry)) {
+			sections[section][m[1]] = m[2];
+		}
+	}
+
+	ruleset rs;
+	rs.fallback = {"Default", sections["Default"]};
+	for (const auto &section : order) {
+		if (section == "mc.ext.ini" ||
+			section == "Default" ||
+			section.substr (0, 8) == "Include/")
+			continue;
+
+		auto full = sections.at (section);
+		if (auto include = full.find ("Include"); include != full.end ()) {
+			full.erase ("Open");
+			full.erase ("View");
+			full.erase ("Edit");
+
+			if (auto included = sections.find ("Include/" + include->second);
+				included != sections.end ()) {
+				for (const auto &kv : included->second)
+					full[kv.first] = kv.second;
+			}
+		}
+		if (!full.count ("Directory"))
+			rs.rules.push_back ({section, full});
+	}
+	return rs;
+}
+
+fun index_rules (ruleset &rs) {
+	for (size_t i = 0; i < rs.rules.size (); i++) {
+		const auto &keys = rs.rules[i].keys;
+		auto shell = keys.find ("Shell");
+		if (shell == keys.end () || keys.count ("Regex")) {
+			rs.unindexed.push_back (i);
+			continue;
+		}
+
+		auto value = shell->second;
+		auto icase = keys.find ("ShellIgnoreCase");
+		bool ignore_case = icase != keys.end () && icase->second == "true";
+		if (ignore_case)
+			value = tolower (value);
+		auto &table = !value.empty () && value[0] == '.'
+			? (ignore_case ? rs.suffixes_icase : rs.suffixes)
+			: (ignore_case ? rs.names_icase : rs.names);
+		table[value].push_back (i);
+	}
+}
+
+/// Return indexes of rules that might match the basename, in order
+fun candidates (const ruleset &rs, const string &basename) -> vector<size_t> {
+	vector<size_t> result = rs.unindexed;
+	auto add = [&](const unordered_map<string, vector<size_t>> &table,
+		const string &key) {
+		if (auto it = table.find (key); it != table.end ())
+			for (auto i : it->second)
+				result.push_back (i);
+	};
+	auto lookup = [&](const string &name, bool ignore_case) {
+		add (ignore_case ? rs.names_icase : rs.names, name);
+		for (auto dot = name.find ('.'); dot != name.npos;
+			dot = name.find ('.', dot + 1))
+			add (ignore_case ? rs.suffixes_icase : rs.suffixes,
+				name.substr (dot));
+	};
+	lookup (basename, false);
+	lookup (tolower (basename), true);
+	sort (result.begin (), result.end ());
+	result.erase (unique (result.begin (), result.end ()), result.end ());
+	return result;
+}
+
+// --- Rule cache --------------------------------------------------------------
+
+// Rather than by path, the configuration is identified by its inode,
+// since it is usually only available as our standard input.
+fun cache_key (const struct stat &info) -> string {
+	return "sdn-mc-ext 1 " + to_string (info.st_dev) + " "
+		+ to_string (info.st_ino) + " " + to_string (info.st_size) + " "
+		+ to_string (info.st_mtim.tv_sec) + "."
+		+ to_string (info.st_mtim.tv_nsec);
+}
+
+fun cache_path () -> string {
+	if (auto cache = getenv ("XDG_CACHE_HOME"); cache && *cache == '/')
+		return string (cache) + "/sdn/mc-ext";
+	if (auto home = getenv ("HOME"))
+		return string (home) + "/.cache/sdn/mc-ext";
+	return "";
+}
+
+fun write_string (ostream &out, const string &s) {
+	out << s.length () << ' ' << s;
+}
+
+/// Return how many bytes there are left to read, so that lengths and counts
+/// from a damaged cache can be rejected before anything is allocated for them
+fun stream_left (istream &in) -> size_t {
+	auto here = in.tellg ();
+	if (here < 0 || !in.seekg (0, ios::end))
+		return 0;
+	auto end = in.tellg ();
+	in.seekg (here);
+	return end > here ? size_t (end - here) : 0;
+}
+
+fun read_string (istream &in, string &s) -> bool {
+	size_t length = 0;
+	if (!(in >> length) || in.get () != ' ' || length > stream_left (in))
+		return false;
+	s.resize (length);
+	return bool (in.read (&s[0], length));
+}
+
+fun write_rule (ostream &out, const rule &r) {
+	write_string (out, r.name);
+	out << r.keys.size () << ' ';
+	for (const auto &kv : r.keys) {
+		write_string (out, kv.first);
+		write_string (out, kv.second);
+	}
+}
+
+fun read_rule (istream &in, rule &r) -> bool {
+	size_t count = 0;
+	if (!read_string (in, r.name) || !(in >> count) || in.get () != ' ')
+		return false;
+	string key, value;
+	while (count--) {
+		if (!read_string (in, key) || !read_string (in, value))
+			return false;
+		r.keys[key] = value;
+	}
+	return true;
+}
+
+fun cache_load (const string &path, const string &key, ruleset &rs) -> bool {
+	ifstream in (path, ios::binary);
+	string line;
+	if (!getline (in, line) || line != key)
+		return false;
+
+	size_t count = 0;
+	if (!read_rule (in, rs.fallback) || !(in >> count) || in.get () != ' ')
+		return false;
+
+	// Each rule takes up at least a few bytes of the file
+	if (count > stream_left (in))
+		return false;
+	rs.rules.resize (count);
+	for (auto &r : rs.rules)
+		if (!read_rule (in, r))
+			return false;
+	return true;
+}
+
+// Failing to save the cache is not an issue worth reporting.
+fun cache_save (const string &path, const string &key, const ruleset &rs) {
+	for (auto slash = path.find ('/', 1); slash != path.npos;
+		slash = path.find ('/', slash + 1))
+		(void) mkdir (path.substr (0, slash).c_str (), 0755);
+
+	string temporary = path + ".XXXXXX";
+	int fd = mkstemp (&temporary[0]);
+	if (fd < 0)
+		return;
+	close (fd);
+
+	ofstream out (temporary, ios::binary | ios::trunc);
+	out << key << endl;
+	write_rule (out, rs.fallback);
+	out << rs.rules.size () << ' ';
+	for (const auto &r : rs.rules)
+		write_rule (out, r);
+	out.close ();
+	if (!out || rename (temporary.c_str (), path.c_str ()))
+		unlink (temporary.c_str ());
+}
+
+/// Read the configuration, unless it's been cached, as identified by
+/// the information about the file it comes from, if it is a regular one
+fun load (istream &in, const struct stat *info) -> ruleset {
+	ruleset rs;
+	auto path = cache_path ();
+	if (path.empty () || !info || !S_ISREG (info->st_mode))
+		rs = parse (in);
+	else if (auto key = cache_key (*info); !cache_load (path, key, rs))
+		cache_save (path, key, (rs = parse (in)));
+
+	index_rules (rs);
+	return rs;
+}
+
+// --- Matching ----------------------------------------------------------------
 
 fun expand_command (string command) -> pair<string, string> {
 	regex re_sequence {R"(%(%|[[:alpha:]]*\{([^}]*)\}|[[:alpha:]]+))"};
@@ -104,11 +530,6 @@ fun expand_command (string command) -> pair<string, string> {
 		pipe.empty () ? out.append (command) : "(" + out + ")" + pipe};
 }
 
-fun print_command (string cmd) {
-	auto command = expand_command (cmd);
-	cout << get<0> (command) << endl << get<1> (command) << endl;
-}
-
 fun section_matches (const unordered_map<string, string> &section) -> bool {
 	if (section.count ("Directory"))
 		return false;
@@ -158,65 +579,94 @@ fun section_matches (const unordered_map<string, string> &section) -> bool {
 	return !arg_type.empty ();
 }
 
-fun process (const string &section) -> bool {
-	auto full = sections.at (section);
-	if (auto include = full.find ("Include"); include != full.end ()) {
-		full.erase ("Open");
-		full.erase ("View");
-		full.erase ("Edit");
-
-		if (auto included = sections.find ("Include/" + include->second);
-			included != sections.end ()) {
-			for (const auto &kv : included->second)
-				full[kv.first] = kv.second;
-		}
-	}
+fun process (const rule &r) -> bool {
 	if (getenv ("SDN_MC_EXT_DEBUG")) {
-		cerr << "[" << section << "]" << endl;
-		for (const auto &kv : full)
+		cerr << "[" << r.name << "]" << endl;
+		for (const auto &kv : r.keys)
 			cerr << "  " << kv.first << ": " << kv.second << endl;
 	}
-	if (full.count (arg_verb) && section_matches (full)) {
-		print_command (full[arg_verb]);
-		return true;
-	}
-	return false;
+	return r.keys.count (arg_verb) && section_matches (r.keys);
 }
 
-int main (int argc, char *argv[]) {
-	if (argc != 6) {
-		cerr << "Usage: " << argv[0]
-			<< " TYPE PATH BASENAME DIRNAME VERB < mc.ext.ini" << endl;
-		return 2;
+/// Find the command for the current arguments, and expand it
+fun lookup (ruleset &rs) -> pair<string, string> {
+	for (auto i : candidates (rs, arg_basename))
+		if (process (rs.rules[i]))
+			return expand_command (rs.rules[i].keys.at (arg_verb));
+	return expand_command (rs.fallback.keys[arg_verb]);
+}
+
+fun resolve (const char *verb, const char *path) {
+	arg_verb = verb;
+	arg_type = file_type (path);
+	if (auto resolved = realpath (path, nullptr)) {
+		arg_path = resolved;
+		free (resolved);
+	} else {
+		arg_path = path;
 	}
+	arg_basename = path_basename (path);
+	arg_dirname = path_dirname (arg_path);
 
-	arg_type = argv[1];
-	arg_path = argv[2], arg_basename = argv[3], arg_dirname = argv[4];
-	arg_verb = argv[5];
+	// Commands may refer to these through %var{}, as they would with mc
+	setenv ("MC_EXT_FILENAME", arg_path.c_str (), true);
+	setenv ("MC_EXT_BASENAME", arg_basename.c_str (), true);
+	setenv ("MC_EXT_CURRENTDIR", arg_dirname.c_str (), true);
+	if (getenv ("SDN_MC_EXT_DEBUG"))
+		cerr << "type: " << arg_type << endl;
+}
 
-	string line, section;
-	vector<string> order;
-	regex re_entry {R"(^([-\w]+) *= *(.*)$)"};
-	smatch m;
-	while (getline (cin, line)) {
-		if (line.empty () || line[0] == '#') {
-			continue;
-		} else if (auto length = line.length();
-			line.find_last_of ('[') == 0 &&
-			line.find_first_of (']') == length - 1) {
-			order.push_back ((section = line.substr (1, length - 2)));
-		} else if (regex_match (line, m, re_entry)) {
-			sections[section][m[1]] = m[2];
+/// Answer NUL-terminated VERB PATH requests with NUL-terminated KIND, COMMAND,
+/// PATH, BASENAME, and DIRNAME, following changes to the configuration
+fun serve (const string &config) -> int {
+	ruleset rs;
+	string key = "\n", verb, path;
+	while (getline (cin, verb, '\0') && getline (cin, path, '\0')) {
+		struct stat info = {};
+		bool found = !config.empty () && !stat (config.c_str (), &info);
+		if (auto current = found ? cache_key (info) : ""; current != key) {
+			ifstream in;
+			if (found)
+				in.open (config);
+			rs = load (in, found ? &info : nullptr);
+			key = current;
 		}
+
+		resolve (verb.c_str (), path.c_str ());
+		auto command = lookup (rs);
+		for (const auto &field : {get<0> (command), get<1> (command),
+			arg_path, arg_basename, arg_dirname})
+			cout << field << '\0';
+		cout.flush ();
 	}
-	for (const auto &section : order) {
-		if (section == "mc.ext.ini" ||
-			section == "Default" ||
-			section.substr (0, 8) == "Include/")
-			continue;
-		if (process (section))
-			return 0;
+	return 0;
+}
+
+int main (int argc, char *argv[]) {
+	if (argc == 3 && !strcmp (argv[1], "--server"))
+		return serve (argv[2]);
+
+	// The short form also tells the caller what it has figured out
+	bool resolving = argc == 3;
+	if (resolving) {
+		resolve (argv[1], argv[2]);
+	} else if (argc == 6) {
+		arg_type = argv[1];
+		arg_path = argv[2], arg_basename = argv[3], arg_dirname = argv[4];
+		arg_verb = argv[5];
+	} else {
+		cerr << "Usage: " << argv[0] << " VERB PATH < mc.ext.ini" << endl
+			<< "       " << argv[0]
+			<< " TYPE PATH BASENAME DIRNAME VERB < mc.ext.ini" << endl
+			<< "       " << argv[0] << " --server MC.EXT.INI" << endl;
+		return 2;
 	}
-	print_command (sections["Default"][arg_verb]);
+
+	struct stat info = {};
+	auto rs = load (cin, fstat (STDIN_FILENO, &info) ? nullptr : &info);
+	auto command = lookup (rs);
+	cout << get<0> (command) << endl << get<1> (command) << endl;
+	if (resolving)
+		cout << arg_path << endl << arg_basename << endl << arg_dirname << endl;
 	return 0;
 }
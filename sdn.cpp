@@ -19,19 +19,28 @@
 #define _XOPEN_SOURCE_EXTENDED
 
 #include <algorithm>
+#include <atomic>
 #include <climits>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
 #include <cwchar>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <list>
 #include <locale>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <tuple>
+#include <unordered_map>
 #include <vector>
 
 #include <dirent.h>
@@ -39,8 +48,13 @@
 #include <fnmatch.h>
 #include <grp.h>
 #include <libgen.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
+#include <spawn.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -53,6 +67,10 @@
 #include <acl/libacl.h>
 #include <sys/acl.h>
 #include <sys/xattr.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#include <sys/sysmacros.h>
+#endif
 #elif !defined __CYGWIN__
 #include <sys/event.h>
 #endif
@@ -266,6 +284,167 @@ fun underline (const string &s) -> string {
 	return result;
 }
 
+fun monotonic_ts_ms () -> int64_t {
+	timespec ts{1, 0};  // A very specific fail-safe value
+	(void) clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+#define TRACE_PHASES(XX) XX(RELOAD, "reload") XX(READDIR, "readdir") \
+	XX(STAT, "stat") XX(XATTRS, "xattrs") XX(NAMES, "names") \
+	XX(SORT, "sort") XX(DRAW, "draw")
+
+#define XX(id, name) TRACE_ ## id,
+enum { TRACE_PHASES(XX) TRACE_COUNT };
+#undef XX
+
+#ifndef NO_TRACING
+#define XX(id, name) name,
+static const char *g_trace_names[] = {TRACE_PHASES(XX)};
+#undef XX
+
+/// Time spent in phases of work since the last reload, which is cheap enough
+/// to be always collected, and optionally a record of each one of them
+static struct {
+	atomic<int64_t> total_us[TRACE_COUNT];  ///< Summed up over all threads
+	atomic<int64_t> count[TRACE_COUNT]; ///< How many times they've been run
+
+	struct event {
+		int phase;                      ///< What has been running
+		int thread;                     ///< Which thread it has run in
+		int64_t start_us, duration_us;  ///< When, and for how long
+	};
+	string path;                        ///< Where to write out events
+	mutex lock;                         ///< Guards the following
+	vector<event> events;               ///< Recorded phases
+	int threads;                        ///< Threads that have been seen
+	int64_t reload_us;                  ///< When the last reload started
+} g_trace;
+
+/// Time spent by this thread that hasn't been added to g_trace yet,
+/// so that workers don't contend over the same counters for every entry
+static thread_local struct {
+	int64_t total_us[TRACE_COUNT];      ///< Summed up within this thread
+	int64_t count[TRACE_COUNT];         ///< How many times they've been run
+} g_trace_local;
+
+fun trace_now_us () -> int64_t {
+	timespec ts{1, 0};
+	(void) clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+fun trace_end (int phase, int64_t start_us) {
+	auto duration_us = trace_now_us () - start_us;
+	g_trace_local.total_us[phase] += duration_us;
+	g_trace_local.count[phase]++;
+	if (g_trace.path.empty ())
+		return;
+
+	// This is bounded to a few dozen megabytes
+	static thread_local int thread = -1;
+	lock_guard<mutex> guard (g_trace.lock);
+	if (thread < 0)
+		thread = g_trace.threads++;
+	if (g_trace.events.size () < 1 << 20)
+		g_trace.events.push_back ({phase, thread, start_us, duration_us});
+}
+
+/// Measures the time spent within a block of code
+struct trace_scope {
+	int phase;
+	int64_t start_us = trace_now_us ();
+
+	trace_scope (int phase) : phase (phase) {}
+	~trace_scope () { trace_end (phase, start_us); }
+};
+
+#define TRACE_NAME2(line) trace_ ## line
+#define TRACE_NAME(line) TRACE_NAME2 (line)
+#define TRACE(phase) trace_scope TRACE_NAME (__LINE__) (TRACE_ ## phase)
+
+// For when a phase doesn't coincide with a block of code
+#define TRACE_BEGIN(phase) auto trace_ ## phase = trace_now_us ()
+#define TRACE_END(phase) trace_end (TRACE_ ## phase, trace_ ## phase)
+#else
+#define TRACE(phase)
+#define TRACE_BEGIN(phase)
+#define TRACE_END(phase)
+#endif
+
+/// Add up what the calling thread has measured, once it's done with a job
+fun trace_flush () {
+#ifndef NO_TRACING
+	for (int i = 0; i < TRACE_COUNT; i++) {
+		if (!g_trace_local.count[i])
+			continue;
+		g_trace.total_us[i] += g_trace_local.total_us[i];
+		g_trace.count[i] += g_trace_local.count[i];
+		g_trace_local.total_us[i] = g_trace_local.count[i] = 0;
+	}
+#endif
+}
+
+/// Describe where time went since the last reload, briefly enough to fit
+/// the status line.  Phases that run in parallel sum up over all threads.
+fun trace_summary () -> string {
+#ifndef NO_TRACING
+	trace_flush ();
+	string summary;
+	for (int i = 0; i < TRACE_COUNT; i++) {
+		if (!g_trace.count[i])
+			continue;
+		if (!summary.empty ())
+			summary += ", ";
+		summary += string (g_trace_names[i]) + " "
+			+ to_string (g_trace.total_us[i] / 1000);
+	}
+	return summary.empty () ? "nothing measured" : summary + " ms";
+#else
+	return "timing instrumentation has been compiled out";
+#endif
+}
+
+/// Start measuring anew, as a reload begins
+fun trace_reload_begin () {
+#ifndef NO_TRACING
+	trace_flush ();
+	for (int i = 0; i < TRACE_COUNT; i++)
+		g_trace.total_us[i] = g_trace.count[i] = 0;
+	g_trace.reload_us = trace_now_us ();
+#endif
+}
+
+fun trace_reload_end () {
+#ifndef NO_TRACING
+	trace_end (TRACE_RELOAD, g_trace.reload_us);
+#endif
+}
+
+/// Write out recorded events in the Chrome trace event format,
+/// which Perfetto and chrome://tracing can open
+fun trace_save () {
+#ifndef NO_TRACING
+	if (g_trace.path.empty ())
+		return;
+
+	lock_guard<mutex> guard (g_trace.lock);
+	ofstream out (g_trace.path, ios::trunc);
+	out << "{\"traceEvents\":[";
+	const char *separator = "\n";
+	for (const auto &e : g_trace.events) {
+		out << separator << "{\"name\":\"" << g_trace_names[e.phase]
+			<< "\",\"ph\":\"X\",\"ts\":" << e.start_us
+			<< ",\"dur\":" << e.duration_us << ",\"pid\":" << getpid ()
+			<< ",\"tid\":" << e.thread << "}";
+		separator = ",\n";
+	}
+	out << "]}" << endl;
+#endif
+}
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 fun xdg_config_home () -> string {
@@ -277,6 +456,15 @@ fun xdg_config_home () -> string {
 	return string (home_dir ? home_dir : "") + "/.config";
 }
 
+fun xdg_state_home () -> string {
+	const char *user_dir = getenv ("XDG_STATE_HOME");
+	if (user_dir && user_dir[0] == '/')
+		return user_dir;
+
+	const char *home_dir = getenv ("HOME");
+	return string (home_dir ? home_dir : "") + "/.local/state";
+}
+
 // In C++17 we will get <optional> but until then there's unique_ptr
 fun xdg_config_find (const string &suffix) -> unique_ptr<ifstream> {
 	vector<string> dirs {xdg_config_home ()};
@@ -310,6 +498,111 @@ fun xdg_config_write (const string &suffix) -> unique_ptr<fstream> {
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+/// Worker threads for blocking calls, which are mostly latency-bound,
+/// especially so on network filesystems
+static struct {
+	mutex lock;
+	condition_variable wake;
+	deque<function<void ()>> jobs;
+	vector<thread> threads;
+	bool stopping;
+} g_pool;
+
+fun pool_worker () {
+	unique_lock<mutex> lock (g_pool.lock);
+	while (true) {
+		g_pool.wake.wait (lock,
+			[] { return g_pool.stopping || !g_pool.jobs.empty (); });
+		if (g_pool.jobs.empty ())
+			return;
+
+		auto job = move (g_pool.jobs.front ());
+		g_pool.jobs.pop_front ();
+		lock.unlock ();
+		job ();
+		trace_flush ();
+		lock.lock ();
+	}
+}
+
+fun pool_size () -> size_t {
+	// Even a single core can keep several requests in flight
+	return max (4u, thread::hardware_concurrency ());
+}
+
+fun pool_submit (function<void ()> job) {
+	{
+		lock_guard<mutex> guard (g_pool.lock);
+		while (g_pool.threads.size () < pool_size ())
+			g_pool.threads.emplace_back (pool_worker);
+		g_pool.jobs.push_back (move (job));
+	}
+	g_pool.wake.notify_one ();
+}
+
+fun pool_stop () {
+	{
+		lock_guard<mutex> guard (g_pool.lock);
+		g_pool.stopping = true;
+		g_pool.jobs.clear ();
+	}
+	g_pool.wake.notify_all ();
+	for (auto &t : g_pool.threads)
+		t.join ();
+	g_pool.threads.clear ();
+}
+
+/// Call `f` for all indexes up to `count`, in parallel, and wait for it.
+/// Spawning work costs more than a few local syscalls, so small counts
+/// are processed serially, unless each item stands for a lot of work.
+fun pool_for (size_t count, const function<void (size_t)> &f,
+	size_t serial_below = 64) {
+	if (count < serial_below) {
+		for (size_t i = 0; i < count; i++)
+			f (i);
+		return;
+	}
+
+	atomic<size_t> next {0};
+	auto run = [&] {
+		for (size_t i; (i = next.fetch_add (1)) < count; )
+			f (i);
+	};
+
+	// Workers may all be busy with long jobs, such as tree walks,
+	// so only wait for helpers that have managed to start in time.
+	// The rest will find out that they have nothing left to do.
+	struct helpers {
+		mutex lock;
+		condition_variable done;
+		size_t running = 0;
+		bool closed = false;
+	};
+	auto shared = make_shared<helpers> ();
+	for (size_t i = pool_size (); i--; )
+		pool_submit ([shared, &run] {
+			{
+				lock_guard<mutex> guard (shared->lock);
+				if (shared->closed)
+					return;
+				shared->running++;
+			}
+			run ();
+			trace_flush ();
+			lock_guard<mutex> guard (shared->lock);
+			if (!--shared->running)
+				shared->done.notify_one ();
+		});
+
+	run ();
+	trace_flush ();
+	unique_lock<mutex> guard (shared->lock);
+	shared->closed = true;
+	shared->done.wait (guard, [&] { return !shared->running; });
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 // This should be basic_string, however that crashes on macOS
 using ncstring = vector<cchar_t>;
 
@@ -446,7 +739,10 @@ enum { ALT = 1 << 24, SYM = 1 << 25 };  // Outside the range of Unicode
 	XX(PAGE_PREVIOUS) XX(PAGE_NEXT) XX(SCROLL_UP) XX(SCROLL_DOWN) XX(CENTER) \
 	XX(CHDIR) XX(PARENT) XX(GO_START) XX(GO_HOME) \
 	XX(SEARCH) XX(RENAME) XX(RENAME_PREFILL) XX(MKDIR) \
-	XX(TOGGLE_FULL) XX(REVERSE_SORT) XX(SHOW_HIDDEN) XX(REDRAW) XX(RELOAD) \
+	XX(TOGGLE_FULL) XX(TOGGLE_PREVIEW) XX(REVERSE_SORT) XX(SORT_MODE) \
+	XX(SHOW_HIDDEN) XX(REDRAW) XX(RELOAD) XX(DISK_USAGE) XX(FIND) \
+	XX(VIEW_BUILTIN) XX(SEARCH_BACKWARD) XX(SEARCH_NEXT) XX(SEARCH_PREVIOUS) \
+	XX(SCROLL_LEFT) XX(SCROLL_RIGHT) XX(TIMINGS) \
 	XX(INPUT_ABORT) XX(INPUT_CONFIRM) XX(INPUT_B_DELETE) XX(INPUT_DELETE) \
 	XX(INPUT_B_KILL_WORD) XX(INPUT_B_KILL_LINE) XX(INPUT_KILL_LINE) \
 	XX(INPUT_QUOTED_INSERT) \
@@ -487,9 +783,11 @@ static map<Key, action> g_normal_actions {
 	{'/', ACTION_SEARCH}, {'s', ACTION_SEARCH}, {CTRL ('S'), ACTION_SEARCH},
 	{ALT | 'e', ACTION_RENAME_PREFILL}, {'e', ACTION_RENAME},
 	{KEY (F (6)), ACTION_RENAME_PREFILL}, {KEY (F (7)), ACTION_MKDIR},
-	{ALT | 't', ACTION_TOGGLE_FULL},
-	{'R', ACTION_REVERSE_SORT}, {ALT | '.', ACTION_SHOW_HIDDEN},
+	{ALT | 't', ACTION_TOGGLE_FULL}, {'p', ACTION_TOGGLE_PREVIEW},
+	{'R', ACTION_REVERSE_SORT}, {'V', ACTION_SORT_MODE},
+	{ALT | '.', ACTION_SHOW_HIDDEN},
 	{CTRL ('L'), ACTION_REDRAW}, {'r', ACTION_RELOAD},
+	{'u', ACTION_DISK_USAGE}, {'v', ACTION_VIEW_BUILTIN},
 };
 static map<Key, action> g_input_actions {
 	{27, ACTION_INPUT_ABORT}, {CTRL ('G'), ACTION_INPUT_ABORT},
@@ -509,11 +807,29 @@ static map<Key, action> g_input_actions {
 static map<Key, action> g_search_actions {
 	{CTRL ('P'), ACTION_UP}, {KEY (UP), ACTION_UP},
 	{CTRL ('N'), ACTION_DOWN}, {KEY (DOWN), ACTION_DOWN},
-	{'/', ACTION_ENTER},
+	{'/', ACTION_ENTER}, {CTRL ('R'), ACTION_FIND},
+};
+static map<Key, action> g_viewer_actions {
+	{'q', ACTION_QUIT}, {KEY (F (3)), ACTION_QUIT}, {KEY (F (10)), ACTION_QUIT},
+	{'k', ACTION_UP}, {'y', ACTION_UP}, {CTRL ('P'), ACTION_UP},
+	{KEY (UP), ACTION_UP}, {CTRL ('Y'), ACTION_UP},
+	{'j', ACTION_DOWN}, {'e', ACTION_DOWN}, {CTRL ('N'), ACTION_DOWN},
+	{KEY (DOWN), ACTION_DOWN}, {CTRL ('E'), ACTION_DOWN},
+	{'\r', ACTION_DOWN}, {KEY (ENTER), ACTION_DOWN},
+	{'b', ACTION_PAGE_PREVIOUS}, {CTRL ('B'), ACTION_PAGE_PREVIOUS},
+	{KEY (PPAGE), ACTION_PAGE_PREVIOUS},
+	{' ', ACTION_PAGE_NEXT}, {'f', ACTION_PAGE_NEXT},
+	{CTRL ('F'), ACTION_PAGE_NEXT}, {KEY (NPAGE), ACTION_PAGE_NEXT},
+	{'g', ACTION_TOP}, {'<', ACTION_TOP}, {KEY (HOME), ACTION_TOP},
+	{'G', ACTION_BOTTOM}, {'>', ACTION_BOTTOM}, {KEY (END), ACTION_BOTTOM},
+	{KEY (LEFT), ACTION_SCROLL_LEFT}, {KEY (RIGHT), ACTION_SCROLL_RIGHT},
+	{'/', ACTION_SEARCH}, {'?', ACTION_SEARCH_BACKWARD},
+	{'n', ACTION_SEARCH_NEXT}, {'N', ACTION_SEARCH_PREVIOUS},
+	{CTRL ('L'), ACTION_REDRAW},
 };
 static const map<string, map<Key, action>*> g_binding_contexts {
 	{"normal", &g_normal_actions}, {"input", &g_input_actions},
-	{"search", &g_search_actions},
+	{"search", &g_search_actions}, {"viewer", &g_viewer_actions},
 };
 
 #define LS(XX) XX(NORMAL, "no") XX(FILE, "fi") XX(RESET, "rs") \
@@ -531,6 +847,45 @@ enum { LS(XX) LS_COUNT };
 static const char *g_ls_colors[] = {LS(XX)};
 #undef XX
 
+/// LS_COLORS filename suffixes, reversed into a trie, so that the longest one
+/// that matches a name can be found in a single pass from its end
+struct ls_suffix_trie {
+	vector<chtype> formats {0};         ///< Formats by node, the root first
+	vector<bool> terminal {false};      ///< Whether a suffix ends at a node
+	unordered_map<uint64_t, uint32_t> edges;  ///< Children by node and byte
+
+	void insert (const string &suffix, chtype format) {
+		uint32_t node = 0;
+		for (auto i = suffix.rbegin (); i != suffix.rend (); i++) {
+			auto key = uint64_t (node) << 8 | uint8_t (*i);
+			auto edge = edges.find (key);
+			if (edge != edges.end ()) {
+				node = edge->second;
+				continue;
+			}
+			node = edges[key] = formats.size ();
+			formats.push_back (0);
+			terminal.push_back (false);
+		}
+		formats[node] = format;
+		terminal[node] = true;
+	}
+
+	/// Return the format for the longest matching suffix of a name, if any
+	const chtype *find (const string &name) const {
+		const chtype *result = nullptr;
+		uint32_t node = 0;
+		for (auto i = name.rbegin (); i != name.rend (); i++) {
+			auto edge = edges.find (uint64_t (node) << 8 | uint8_t (*i));
+			if (edge == edges.end ())
+				break;
+			if (terminal[node = edge->second])
+				result = &formats[node];
+		}
+		return result;
+	}
+};
+
 struct stringcaseless {
 	bool operator () (const string &a, const string &b) const {
 		const auto &c = locale::classic ();
@@ -539,12 +894,210 @@ struct stringcaseless {
 	}
 };
 
+/// A directory entry, kept compact, as there may be millions of them
 struct entry {
-	string filename, target_path;
-	struct stat info = {}, target_info = {};
+	size_t name = 0, target = 0;        ///< Offsets into g.names
+	size_t collated = 0;                ///< Name sort key in g.names, if any
+	mode_t mode = 0, target_mode = 0;   ///< Type and permissions
+	uid_t uid = 0;                      ///< Owning user
+	gid_t gid = 0;                      ///< Owning group
+	off_t size = 0;                     ///< Size in bytes
+	time_t mtime = 0;                   ///< Last modification time
+	dev_t dev = 0; ino_t ino = 0;       ///< Identity of the file
+	chtype name_attrs = 0, target_attrs = 0;  ///< LS_COLORS formatting
+	bool failed = false;                ///< Metadata couldn't be retrieved
+	bool acl = false;                   ///< Has an extended ACL
+	bool selected = false;              ///< Is part of the selection
 
 	enum { MODES, USER, GROUP, SIZE, MTIME, FILENAME, COLUMNS };
-	ncstring cols[COLUMNS];
+
+	const char *filename () const;
+	const char *target_path () const;
+	const char *sort_name () const;
+	off_t total_size () const;
+};
+
+/// How names are ordered
+enum sort_mode { SORT_BYTEWISE, SORT_NATURAL, SORT_LOCALE, SORT_MODES };
+static const char *g_sort_mode_names[] = {"bytewise", "natural", "locale"};
+
+/// Full metadata on an entry, as gathered by make_entry()
+struct metadata {
+	struct stat info = {}, target_info = {};
+	string target_path;
+	string collated;                    ///< Name sort key, unless the name
+	bool have_info = false;             ///< Retrieved in advance
+};
+
+/// What make_entry() is to do, as worker threads mustn't consult g
+struct scan_options {
+	string path;                        ///< Directory path, unless current
+	bool acl = true;                    ///< Look for extended ACLs
+	int sort_mode = SORT_BYTEWISE;      ///< Name sort keys to produce
+};
+
+/// Columns of an entry, as formatted for display
+struct row {
+	ncstring cols[entry::COLUMNS];
+};
+
+/// Names for user or group IDs, looked up as they are needed
+struct id_names {
+	const char *source;                 ///< Local database file
+	map<unsigned, wstring> names = {};  ///< Names by ID
+	tuple<time_t, ino_t, off_t> stamp = {};  ///< Source version
+	int64_t since = 0;                  ///< When the cache was started
+};
+
+/// A search needle, prepared for matching names against it
+struct name_pattern {
+	string needle;                      ///< Names must begin with this glob
+	string glob;                        ///< The same as an fnmatch() pattern
+	bool literal;                       ///< Whether fnmatch() can be skipped
+};
+
+/// Entries matching a search, kept to narrow down the next one
+struct search_cache {
+	string needle;                      ///< Multibyte search string
+	vector<uint32_t> matches;           ///< Matching entry indexes, ascending
+	uint64_t version = -1;              ///< Value of g.entries_version
+};
+
+/// What a line of the listing has last been drawn with
+struct painted_line {
+	uint64_t version = -1;              ///< Value of g.entries_version
+	size_t name = 0;                    ///< Name offset of the entry, if any
+	int state = 0;                      ///< Highlighting and view settings
+
+	bool operator== (const painted_line &o) const {
+		return version == o.version && name == o.name && state == o.state;
+	}
+};
+
+/// Identifies the directory contents a listing has been read from
+struct listing_id {
+	string path;                        ///< Absolute path to the directory
+	struct stat info = {};              ///< Its metadata before reading
+	time_t read_at = 0;                 ///< When reading began
+	bool show_hidden = false;           ///< Whether hidden files are listed
+};
+
+/// A directory listing kept around for when it is returned to
+struct listing {
+	listing_id id;                      ///< What has been read
+	vector<entry> entries;              ///< Directory entries
+	string names;                       ///< Storage for entry names
+	int max_widths[entry::COLUMNS];     ///< Column widths
+	bool have_widths = true;            ///< Column widths are known
+	bool partial_info;                  ///< Entries lack full view details
+	bool truncated;                     ///< Entries have been cut short
+	int sort_mode;                      ///< Name sort keys in entries
+	int wd = -1;                        ///< Watch that keeps it valid
+
+	size_t size () const {
+		return sizeof *this + entries.capacity () * sizeof (entry)
+			+ names.capacity ();
+	}
+};
+
+/// A directory being read in the background, shared with a worker thread
+struct prefetch {
+	string path;                        ///< Absolute path to the directory
+	size_t limit;                       ///< Maximum number of entries, or 0
+	bool show_hidden;                   ///< Whether hidden files are listed
+	scan_options options;               ///< How to retrieve metadata
+	int wd = -1;                        ///< Watch for changes while reading
+	bool dirty = false;                 ///< Changes have been reported
+	atomic<bool> cancelled {false};     ///< The result is no longer wanted
+	atomic<bool> finished {false};      ///< The worker is done with it
+	bool failed = false;                ///< The directory couldn't be read
+	listing result;                     ///< What has been read
+};
+
+/// Contents of the preview pane for an entry, produced on a worker thread
+struct preview {
+	string cwd;                         ///< Directory of the entry
+	string name;                        ///< Filename of the entry in it
+	string path;                        ///< Absolute path to the entry
+	dev_t dev; ino_t ino;               ///< Identity of the entry
+	time_t mtime;                       ///< Version of the entry it is for
+	bool show_hidden;                   ///< Whether hidden files are listed
+	string config;                      ///< mc.ext.ini for non-text files
+	atomic<bool> cancelled {false};     ///< The result is no longer wanted
+	atomic<bool> finished {false};      ///< The worker is done with it
+	string text;                        ///< Lines to show
+	string note;                        ///< What to show instead of text
+};
+
+/// The recursive size of a directory, as computed by a disk usage walk
+struct dir_usage {
+	off_t size;                         ///< Apparent size of all contents
+	time_t mtime;                       ///< Directory version it applies to
+	int64_t expires_at;                 ///< When it's no longer to be trusted
+};
+
+/// A directory that a disk usage walk has started from
+struct du_root {
+	string path;                        ///< Absolute path to the directory
+	dev_t dev; ino_t ino;               ///< Its identity
+	time_t mtime;                       ///< Last modification time
+};
+
+/// A parallel directory tree traversal, shared with worker threads
+struct tree_walk {
+	mutex lock;                         ///< Protects the following group
+	condition_variable wake;            ///< Signals queue and busy changes
+	deque<pair<string, size_t>> queue;  ///< Directories to read, tagged
+	size_t busy = 0;                    ///< Workers reading a directory
+	size_t workers = 0;                 ///< Workers still running
+
+	atomic<bool> cancelled {false};     ///< The result is no longer wanted
+	atomic<bool> finished {false};      ///< All workers are done with it
+};
+
+/// A disk usage walk in progress, tagging directories by root
+struct du_walk : tree_walk {
+	vector<du_root> roots;              ///< Directories to total up
+	set<pair<dev_t, ino_t>> seen;       ///< Files that have been counted
+	vector<off_t> sizes;                ///< Totals by root
+
+	atomic<uint64_t> bytes {0};         ///< Size counted so far
+	atomic<uint64_t> items {0};         ///< Files seen so far
+};
+
+/// A file found by a recursive search, before it's put in g.entries
+struct find_match {
+	string path;                        ///< Path relative to the search root
+	entry e;                            ///< Entry, lacking any names
+	metadata m;                         ///< Strings for the entry
+};
+
+/// A recursive filename search, tagging directories by their depth
+struct find_walk : tree_walk {
+	string root;                        ///< Absolute path to the subtree
+	name_pattern pattern;               ///< What to look for
+	size_t max_depth;                   ///< How deep to descend, or 0
+	bool one_filesystem;                ///< Don't cross mount points
+	dev_t dev;                          ///< Filesystem of the root
+	bool show_hidden;                   ///< Whether hidden files are listed
+	int sort_mode;                      ///< Name sort keys to produce
+	vector<find_match> found;           ///< Matches for the main loop
+};
+
+/// A file, or some text, as shown by the built-in viewer
+struct viewer {
+	string title;                       ///< Shown in the status bar
+	string text;                        ///< Contents, unless mapped
+	const char *data;                   ///< Contents, while being viewed
+	size_t size;                        ///< Length of the contents
+	bool mapped;                        ///< Whether data is a file mapping
+	volatile sig_atomic_t truncated;    ///< The mapping has been lost
+	size_t top;                         ///< Offset of the topmost line shown
+	int column;                         ///< Horizontal scroll, in cells
+	size_t bottom;                      ///< Offset of the last top line
+	int bottom_rows = -1;               ///< Screen height bottom is for
+	string needle;                      ///< Last searched for text
+	bool backwards;                     ///< Last search direction
 };
 
 struct level {
@@ -558,8 +1111,17 @@ static struct {
 	string cwd;                         ///< Current working directory
 	string start_dir;                   ///< Starting directory
 	vector<entry> entries;              ///< Current directory entries
-	set<string> selection;              ///< Filenames of selected entries
+	uint64_t entries_version;           ///< Changes with entries or order
+	vector<uint32_t> by_name;           ///< Entry indexes ordered by name
+	uint64_t by_name_version = -1;      ///< Value of entries_version
+	search_cache last_match;            ///< Results of the last match()
+	string names = string (1, 0);       ///< Storage for entry names
+	size_t names_garbage;               ///< Unused bytes within names
+	size_t selected;                    ///< Number of selected entries
+	uint64_t selected_size;             ///< Total size of selected entries
+	set<string> reselect;               ///< Selected names yet to be loaded
 	vector<level> levels;               ///< Upper directory levels
+	bool history_damaged;               ///< History store needs rewriting
 	int offset, cursor;                 ///< Scroll offset and cursor position
 	bool full_view;                     ///< Show extended information
 	bool gravity;                       ///< Entries are shoved to the bottom
@@ -567,19 +1129,78 @@ static struct {
 	bool show_hidden;                   ///< Show hidden files
 	bool ext_helpers;                   ///< Launch helpers externally
 	int max_widths[entry::COLUMNS];     ///< Column widths
+	unordered_map<size_t, row> rows;    ///< Formatted entries by name
 	int sort_column = entry::FILENAME;  ///< Sorting column
-	int sort_flash_ttl;                 ///< Sorting column flash TTL
+	int sort_mode = SORT_BYTEWISE;      ///< Name ordering
+
+	vector<painted_line> painted;       ///< Listing lines as on the screen
+	int painted_cols;                   ///< Terminal width they're for
+	int painted_top;                    ///< Entry index they start with
+	tuple<string, bool, bool, bool, int, wstring> painted_bar;  ///< Status bar
+	int64_t sort_flash_until;           ///< Sorting column flash deadline
 
 	wstring message;                    ///< Message for the user
-	int message_ttl;                    ///< Time to live for the message
+	int64_t message_until;              ///< Message expiry deadline
 
 	vector<string> chosen;              ///< Chosen items for the command line
 	string ext_helper;                  ///< External helper to run
+	string mc_ext_ini;                  ///< mc.ext.ini for our helpers
+	bool mc_ext_ini_known;              ///< mc.ext.ini has been looked for
+	pid_t mc_ext_pid;                   ///< sdn-mc-ext process, or -1
+	int mc_ext_fds[2] = {-1, -1};       ///< Its standard input and output
 	bool no_chdir;                      ///< Do not tell the shell to chdir
 	bool quitting;                      ///< Whether we should quit already
 
 	int watch_fd, watch_wd = -1;        ///< File watch (inotify/kqueue)
 	bool out_of_date;                   ///< Entries may be out of date
+	DIR *loading;                       ///< Directory still being read
+	string load_anchor;                 ///< Entry to focus once read
+	bool partial_info;                  ///< Entries lack full view details
+	bool truncated;                     ///< Entries have been cut short
+	size_t entry_limit = 1000000;       ///< Most entries to keep in memory
+	bool out_of_sync;                   ///< Changes require a full reload
+	set<string> changed;                ///< Names of entries that changed
+	bool watch_pending;                 ///< Unannounced file watch events
+	int64_t watch_last;                 ///< When changes were last announced
+	int watch_interval = 200;           ///< Minimum announcement interval
+	size_t watch_limit = 1000;          ///< Incremental reload name limit
+	bool auto_reload;                   ///< Apply changes automatically
+	bool watch_refreshing;              ///< Automatic refresh still loading
+	int64_t watch_cost;                 ///< Duration of the last refresh
+
+	listing_id listed;                  ///< Source of current entries
+	list<listing> listings;             ///< Earlier listings, recent first
+	size_t listings_size;               ///< Memory used by listings
+	size_t listings_limit = 32 << 20;   ///< Memory limit for listings
+	int wake_fds[2] = {-1, -1};         ///< Self-pipe for worker threads
+
+	shared_ptr<prefetch> prefetching;   ///< Directory being prefetched
+	string prefetch_path;               ///< Directory to prefetch next
+	int64_t prefetch_at;                ///< When to start prefetching it
+	set<string> prefetch_tried;         ///< Directories not to retry
+	size_t prefetch_limit = 1000;       ///< Largest prefetched directory
+
+	bool show_preview;                  ///< Show a preview pane
+	shared_ptr<preview> previewing;     ///< Preview being produced
+	string preview_path;                ///< Entry to preview next
+	int64_t preview_at;                 ///< When to start producing it
+	list<shared_ptr<preview>> previews; ///< Finished previews, recent first
+
+	map<pair<dev_t, ino_t>, dir_usage> usage;  ///< Known directory sizes
+	shared_ptr<du_walk> du;             ///< Disk usage walk in progress
+	int64_t du_progress_at;             ///< When to indicate progress next
+	int64_t du_expire_at;               ///< When a known size expires next
+
+	shared_ptr<find_walk> finding;      ///< Recursive search in progress
+	bool find_mode;                     ///< Entries are search results
+	listing find_saved;                 ///< Directory entries meanwhile
+	level find_level;                   ///< Directory position meanwhile
+	int64_t find_check_at;              ///< When to take in matches next
+	size_t find_depth;                  ///< Recursive search depth, or 0
+	bool find_xdev;                     ///< Stay on the same filesystem
+	vector<string> no_xattrs;           ///< Filesystems to skip ACLs on
+
+	viewer view;                        ///< Built-in viewer
 
 	const wchar_t *editor;              ///< Prompt string for editing
 	wstring editor_info;                ///< Right-side prompt while editing
@@ -595,8 +1216,8 @@ static struct {
 	const char *attr_names[AT_COUNT] =
 		{"cursor", "select", "bar", "cwd", "input", "info", "cmdline"};
 
-	map<int, chtype> ls_colors;         ///< LS_COLORS decoded
-	map<string, chtype> ls_exts;        ///< LS_COLORS file extensions
+	chtype ls_colors[LS_COUNT] = {};    ///< LS_COLORS decoded
+	ls_suffix_trie ls_suffixes;         ///< LS_COLORS filename suffixes
 	bool ls_symlink_as_target;          ///< ln=target in dircolors
 
 	map<string, Key, stringcaseless> name_to_key;
@@ -606,27 +1227,107 @@ static struct {
 
 	// Refreshed by reload():
 
-	map<uid_t, wstring> unames;         ///< User names by UID
-	map<gid_t, wstring> gnames;         ///< Group names by GID
+	id_names unames {"/etc/passwd"};    ///< User names by UID
+	id_names gnames {"/etc/group"};     ///< Group names by GID
 	struct tm now;                      ///< Current local time for display
 } g;
 
+auto entry::filename () const -> const char * {
+	return g.names.c_str () + name;
+}
+
+auto entry::target_path () const -> const char * {
+	return g.names.c_str () + target;
+}
+
+auto entry::sort_name () const -> const char * {
+	return collated ? g.names.c_str () + collated : filename ();
+}
+
+/// Find out the recursive size of a directory entry, if it is known
+fun du_lookup (const entry &e) -> const dir_usage * {
+	if (!S_ISDIR (e.mode))
+		return nullptr;
+	auto i = g.usage.find ({e.dev, e.ino});
+	return i != g.usage.end () && i->second.mtime == e.mtime
+		? &i->second : nullptr;
+}
+
+/// Return the size of the entry, including any directory contents
+auto entry::total_size () const -> off_t {
+	auto usage = du_lookup (*this);
+	return usage ? usage->size : size;
+}
+
+/// Store a name for an entry, returning its offset
+fun intern (string &names, const char *name) -> size_t {
+	auto offset = names.size ();
+	names.append (name, strlen (name) + 1);
+	return offset;
+}
+
+fun intern (const char *name) -> size_t {
+	return intern (g.names, name);
+}
+
+/// Account for a name that is no longer referred to
+fun release (size_t offset) {
+	if (offset)
+		g.names_garbage += strlen (g.names.c_str () + offset) + 1;
+}
+
+#ifdef __linux__
+/// Extended attributes that filesystems, by device, turn out not to support,
+/// so that they aren't asked for again for each file.  Shared with workers.
+static struct {
+	mutex lock;
+	unordered_map<dev_t, int> missing;  ///< XATTR_* flags by device
+} g_xattrs;
+
+enum { XATTR_ACL = 1 << 0, XATTR_CAPABILITY = 1 << 1 };
+
+fun xattrs_missing (dev_t dev) -> int {
+	lock_guard<mutex> guard (g_xattrs.lock);
+	auto i = g_xattrs.missing.find (dev);
+	return i != g_xattrs.missing.end () ? i->second : 0;
+}
+
+/// Take note of a failure to retrieve an extended attribute
+fun xattrs_failed (dev_t dev, int which) {
+	if (errno != ENOTSUP && errno != EOPNOTSUPP)
+		return;
+	lock_guard<mutex> guard (g_xattrs.lock);
+	g_xattrs.missing[dev] |= which;
+}
+
+/// Don't look for extended attributes on the filesystem at the given path
+fun xattrs_skip (const string &path) {
+	struct stat info = {};
+	if (!stat (path.c_str (), &info)) {
+		lock_guard<mutex> guard (g_xattrs.lock);
+		g_xattrs.missing[info.st_dev] = XATTR_ACL | XATTR_CAPABILITY;
+	}
+}
+#endif
+
 // The coloring logic has been more or less exactly copied from GNU ls,
 // simplified and rewritten to reflect local implementation specifics
 fun ls_is_colored (int type) -> bool {
-	auto i = g.ls_colors.find (type);
-	return i != g.ls_colors.end () && i->second != 0;
+	return g.ls_colors[type] != 0;
 }
 
-fun ls_format (const entry &e, bool for_target) -> chtype {
+/// Pick LS_COLORS formatting for an entry, where `dir` is the path that
+/// its filename is relative to, or empty for the current working directory
+fun ls_format (const string &dir, const string &filename, const metadata &m,
+	bool for_target) -> chtype {
 	int type = LS_ORPHAN;
 	auto set = [&](int t) { if (ls_is_colored (t)) type = t; };
 
 	const auto &name = for_target
-		? e.target_path : e.filename;
+		? m.target_path : filename;
 	const auto &info =
-		(for_target || (g.ls_symlink_as_target && e.target_info.st_mode))
-		? e.target_info : e.info;
+		(for_target || (g.ls_symlink_as_target && m.target_info.st_mode))
+		? m.target_info : m.info;
 
 	if (for_target && info.st_mode == 0) {
 		// This differs from GNU ls: we use ORPHAN when MISSING is not set,
@@ -639,8 +1340,17 @@ fun ls_format (const entry &e, bool for_target) -> chtype {
 		if ((info.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)))
 			set (LS_EXECUTABLE);
 #ifdef __linux__
-		if (lgetxattr (name.c_str (), "security.capability", NULL, 0) >= 0)
-			set (LS_CAPABILITY);
+		// Unless this gets coloured, it's a wasted system call per file
+		if (ls_is_colored (LS_CAPABILITY)
+		 && !(xattrs_missing (info.st_dev) & XATTR_CAPABILITY)) {
+			TRACE (XATTRS);
+			auto path = dir.empty () || name[0] == '/'
+				? name : dir + "/" + name;
+			if (lgetxattr (path.c_str (), "security.capability", NULL, 0) >= 0)
+				set (LS_CAPABILITY);
+			else
+				xattrs_failed (info.st_dev, XATTR_CAPABILITY);
+		}
 #endif
 		if ((info.st_mode & S_ISGID))
 			set (LS_SETGID);
@@ -656,7 +1366,7 @@ fun ls_format (const entry &e, bool for_target) -> chtype {
 			set (LS_STICKY_OTHER_WRITABLE);
 	} else if (S_ISLNK (info.st_mode)) {
 		type = LS_SYMLINK;
-		if (!e.target_info.st_mode &&
+		if (!m.target_info.st_mode &&
 			(ls_is_colored (LS_ORPHAN) || g.ls_symlink_as_target))
 			type = LS_ORPHAN;
 	} else if (S_ISFIFO (info.st_mode)) {
@@ -669,18 +1379,8 @@ fun ls_format (const entry &e, bool for_target) -> chtype {
 		type = LS_CHARACTER;
 	}
 
-	chtype format = 0;
-	const auto x = g.ls_colors.find (type);
-	if (x != g.ls_colors.end ())
-		format = x->second;
-
-	auto dot = name.find_last_of ('.');
-	if (dot != string::npos && type == LS_FILE) {
-		const auto x = g.ls_exts.find (name.substr (++dot));
-		if (x != g.ls_exts.end ())
-			format = x->second;
-	}
-	return format;
+	auto suffix = type == LS_FILE ? g.ls_suffixes.find (name) : nullptr;
+	return suffix ? *suffix : g.ls_colors[type];
 }
 
 fun suffixize (off_t size, unsigned shift, wchar_t suffix, std::wstring &out)
@@ -702,150 +1402,802 @@ fun suffixize (off_t size, unsigned shift, wchar_t suffix, std::wstring &out)
 	return false;
 }
 
-fun make_entry (const struct dirent *f) -> entry {
-	entry e;
-	e.filename = f->d_name;
-	e.info.st_mode = DTTOIF (f->d_type);
-	auto &info = e.info;
+/// Transform a name so that the current sort mode orders it bytewise.
+/// Returns an empty string when the name can be used as it is.
+fun collation_key (const char *name, int mode) -> string {
+	string result;
+	if (mode == SORT_LOCALE) {
+		result.resize (strxfrm (nullptr, name, 0) + 1);
+		result.resize (strxfrm (&result[0], name, result.size ()));
+	} else if (mode == SORT_NATURAL) {
+		// Mark numbers and prefix them with their length, which names limit
+		// to a single byte.  Numbers thus order by value, and before letters.
+		for (auto p = name; *p; ) {
+			if (!isdigit ((unsigned char) *p)) {
+				result += *p++;
+				continue;
+			}
+			while (p[0] == '0' && isdigit ((unsigned char) p[1]))
+				p++;
+			auto digits = p;
+			while (isdigit ((unsigned char) *p))
+				p++;
+			result.append (1, '0').append (1, char (min<ptrdiff_t> (p - digits,
+				UCHAR_MAX))).append (digits, p - digits);
+		}
+	}
+	if (result == name)
+		result.clear ();
+	return result;
+}
+
+/// Retrieve metadata for an entry that has so far only been named,
+/// and summarize it.  Relative paths are resolved against `dir`,
+/// which must refer to the current working directory, or to `options.path`,
+/// as some calls only take paths.  This may run on worker threads, and must
+/// not modify any global state.  With `have_info`, `info` has already been
+/// filled in, as has `target_info` of symlinks, if they could be resolved.
+/// The caller is responsible for storing strings using store_metadata().
+fun make_entry (int dir, const char *name, entry &e, metadata &m,
+	const scan_options &options) {
+	string filename = name;
+	m.collated = collation_key (name, options.sort_mode);
+	auto &info = m.info;
+	if (!m.have_info)
+		info.st_mode = e.mode;
 
 	// io_uring is only at most about 50% faster, though it might help with
 	// slowly statting devices, at a major complexity cost.
-	if (lstat (f->d_name, &info)) {
-		e.cols[entry::MODES] = apply_attrs ({ decode_type (info.st_mode),
-			L'?', L'?', L'?', L'?', L'?', L'?', L'?', L'?', L'?' }, 0);
-
-		e.cols[entry::USER] = e.cols[entry::GROUP] =
-		e.cols[entry::SIZE] = e.cols[entry::MTIME] = apply_attrs (L"?", 0);
-
-		e.cols[entry::FILENAME] =
-			apply_attrs (to_wide (e.filename), ls_format (e, false));
-		return e;
+	// Network filesystems gain a lot more from callers parallelizing this.
+	bool failed = false;
+	if (!m.have_info) {
+		TRACE (STAT);
+		failed = fstatat (dir, filename.c_str (), &info, AT_SYMLINK_NOFOLLOW);
+	}
+	if (failed) {
+		e.failed = true;
+		e.name_attrs = ls_format (options.path, filename, m, false);
+		return;
 	}
 
 	if (S_ISLNK (info.st_mode)) {
 		char buf[PATH_MAX] = {};
-		auto len = readlink (f->d_name, buf, sizeof buf);
+		auto len = readlinkat (dir, filename.c_str (), buf, sizeof buf);
 		if (len < 0 || size_t (len) >= sizeof buf) {
-			e.target_path = "?";
+			m.target_path = "?";
 		} else {
-			e.target_path = buf;
+			m.target_path = buf;
 			// If a symlink links to another symlink, we follow all the way
-			(void) stat (buf, &e.target_info);
+			if (!m.target_info.st_mode)
+				(void) fstatat (dir, buf, &m.target_info, 0);
 		}
 	}
 
-	auto mode = decode_mode (info.st_mode);
 #ifdef __linux__
 	// We're using a laughably small subset of libacl: this translates to
 	// two lgetxattr() calls, the results of which are compared with
 	// specific architecture-dependent constants.  Linux-only.
-	if (acl_extended_file_nofollow (f->d_name) > 0)
-		mode += L"+";
+	auto path = options.path.empty ()
+		? filename : options.path + "/" + filename;
+	if (options.acl && !(xattrs_missing (info.st_dev) & XATTR_ACL)) {
+		TRACE (XATTRS);
+		auto acl = acl_extended_file_nofollow (path.c_str ());
+		if (acl < 0)
+			xattrs_failed (info.st_dev, XATTR_ACL);
+		e.acl = acl > 0;
+	}
 #endif
-	e.cols[entry::MODES] = apply_attrs (mode, 0);
-
-	auto usr = g.unames.find (info.st_uid);
-	e.cols[entry::USER] = (usr != g.unames.end ())
-		? apply_attrs (usr->second, 0)
-		: apply_attrs (to_wstring (info.st_uid), 0);
-
-	auto grp = g.gnames.find (info.st_gid);
-	e.cols[entry::GROUP] = (grp != g.gnames.end ())
-		? apply_attrs (grp->second, 0)
-		: apply_attrs (to_wstring (info.st_gid), 0);
-
-	std::wstring size;
-	if (!suffixize (info.st_size, 40, L'T', size) &&
-		!suffixize (info.st_size, 30, L'G', size) &&
-		!suffixize (info.st_size, 20, L'M', size) &&
-		!suffixize (info.st_size, 10, L'K', size))
-		size = to_wstring (info.st_size);
-	e.cols[entry::SIZE] = apply_attrs (size, 0);
 
+	e.mode = info.st_mode;
+	e.target_mode = m.target_info.st_mode;
+	e.uid = info.st_uid;
+	e.gid = info.st_gid;
+	e.size = info.st_size;
+	e.mtime = info.st_mtime;
+	e.dev = info.st_dev;
+	e.ino = info.st_ino;
+
+	e.name_attrs = ls_format (options.path, filename, m, false);
+	if (!m.target_path.empty ())
+		e.target_attrs = ls_format (options.path, filename, m, true);
+}
+
+/// Store strings that make_entry() has produced for an entry
+fun store_metadata (entry &e, const metadata &m, string &names = g.names) {
+	if (!m.target_path.empty ())
+		e.target = intern (names, m.target_path.c_str ());
+	if (!m.collated.empty ())
+		e.collated = intern (names, m.collated.c_str ());
+}
+
+/// Options for make_entry() on the current directory
+fun scan_here () -> scan_options {
+	return {"", !g.partial_info, g.sort_mode};
+}
+
+fun format_size (off_t size) -> wstring {
+	wstring out;
+	if (!suffixize (size, 40, L'T', out) &&
+		!suffixize (size, 30, L'G', out) &&
+		!suffixize (size, 20, L'M', out) &&
+		!suffixize (size, 10, L'K', out))
+		out = to_wstring (size);
+	return out;
+}
+
+fun format_mtime (time_t mtime) -> wstring {
 	wchar_t buf[32] = L"";
-	auto tm = localtime (&info.st_mtime);
+	struct tm tm {};
+	localtime_r (&mtime, &tm);
 	wcsftime (buf, sizeof buf / sizeof *buf,
-		(tm->tm_year == g.now.tm_year) ? L"%b %e %H:%M" : L"%b %e  %Y", tm);
-	e.cols[entry::MTIME] = apply_attrs (buf, 0);
+		(tm.tm_year == g.now.tm_year) ? L"%b %e %H:%M" : L"%b %e  %Y", &tm);
+	return buf;
+}
 
-	auto &fn = e.cols[entry::FILENAME] =
-		apply_attrs (to_wide (e.filename), ls_format (e, false));
-	if (!e.target_path.empty ()) {
-		fn += apply_attrs (L" -> ", 0);
-		fn += apply_attrs (to_wide (e.target_path), ls_format (e, true));
+/// Forget all names if the database may have changed since they were cached
+fun id_names_validate (id_names &cache) {
+	struct stat info = {};
+	(void) stat (cache.source, &info);
+	auto stamp = make_tuple (info.st_mtime, info.st_ino, info.st_size);
+
+	// Network sources such as LDAP give no sign of changes, so also expire
+	auto now = monotonic_ts_ms ();
+	if (stamp != cache.stamp || now - cache.since > 5 * 60 * 1000) {
+		cache.names.clear ();
+		cache.stamp = stamp;
+		cache.since = now;
 	}
-	return e;
 }
 
-fun inline visible_lines () -> int { return max (0, LINES - 2); }
+fun resolve_user (unsigned uid) -> wstring {
+	TRACE (NAMES);
+	struct passwd pw = {}, *result = nullptr;
+	vector<char> buf (1024);
+	while (getpwuid_r (uid, &pw, buf.data (), buf.size (), &result) == ERANGE)
+		buf.resize (buf.size () * 2);
+	return result ? to_wide (result->pw_name) : to_wstring (uid);
+}
 
-fun update () {
-	int start_column = g.full_view ? 0 : entry::FILENAME;
-	static int alignment[entry::COLUMNS] = {-1, -1, -1, 1, 1, -1};
-	erase ();
+fun resolve_group (unsigned gid) -> wstring {
+	TRACE (NAMES);
+	struct group gr = {}, *result = nullptr;
+	vector<char> buf (1024);
+	while (getgrgid_r (gid, &gr, buf.data (), buf.size (), &result) == ERANGE)
+		buf.resize (buf.size () * 2);
+	return result ? to_wide (result->gr_name) : to_wstring (gid);
+}
 
-	int available = visible_lines ();
-	int all = g.entries.size ();
-	int used = min (available, all - g.offset);
-	for (int i = 0; i < used; i++) {
-		auto index = g.offset + i;
-		bool cursored = index == g.cursor;
-		bool selected = g.selection.count (g.entries[index].filename);
-		chtype attrs {};
-		if (selected)
-			attrs = g.attrs[g.AT_SELECT];
-		if (cursored)
-			attrs = g.attrs[g.AT_CURSOR] | (attrs & ~A_COLOR);
-		attrset (attrs);
+/// Look up IDs only once they're needed, as enumerating all of them
+/// may involve a lot of network traffic.  Unknown IDs are cached, too.
+fun format_id (id_names &cache, unsigned id, wstring (*resolve) (unsigned))
+	-> const wstring & {
+	auto i = cache.names.find (id);
+	if (i == cache.names.end ())
+		i = cache.names.emplace (id, resolve (id)).first;
+	return i->second;
+}
 
-		move (g.gravity ? (available - used + i) : i, 0);
+fun format_user (uid_t uid) -> const wstring & {
+	return format_id (g.unames, uid, resolve_user);
+}
 
-		auto used = 0;
-		for (int col = start_column; col < entry::COLUMNS; col++) {
-			const auto &field = g.entries[index].cols[col];
-			auto aligned = align (field, alignment[col] * g.max_widths[col]);
-			if (cursored || selected)
-				for_each (begin (aligned), end (aligned), decolor);
-			if (g.sort_flash_ttl && col == g.sort_column)
-				for_each (begin (aligned), end (aligned), invert);
-			used += print (aligned + apply_attrs (L" ", 0), COLS - used);
-		}
-		hline (' ', COLS - used);
-	}
+fun format_group (gid_t gid) -> const wstring & {
+	return format_id (g.gnames, gid, resolve_group);
+}
 
-	auto bar = apply_attrs (to_wide (g.cwd), g.attrs[g.AT_CWD]);
-	if (!g.show_hidden)
-		bar += apply_attrs (L" (hidden)", 0);
-	if (g.out_of_date)
-		bar += apply_attrs (L" [+]", 0);
+/// Format all columns of an entry, which is costly, so only do this on demand
+fun make_row (const entry &e) -> row {
+	row r;
+	if (e.failed) {
+		r.cols[entry::MODES] = apply_attrs ({ decode_type (e.mode),
+			L'?', L'?', L'?', L'?', L'?', L'?', L'?', L'?', L'?' }, 0);
 
-	move (LINES - 2, 0);
-	attrset (g.attrs[g.AT_BAR]);
-	int unused = COLS - print (bar, COLS);
-	hline (' ', unused);
+		r.cols[entry::USER] = r.cols[entry::GROUP] =
+		r.cols[entry::SIZE] = r.cols[entry::MTIME] = apply_attrs (L"?", 0);
 
-	auto pos = to_wstring (int (double (g.offset) / all * 100)) + L"%";
-	if (used == all)
-		pos = L"All";
-	else if (g.offset == 0)
-		pos = L"Top";
-	else if (g.offset + used == all)
-		pos = L"Bot";
+		r.cols[entry::FILENAME] =
+			apply_attrs (to_wide (e.filename ()), e.name_attrs);
+		return r;
+	}
 
-	if (int (pos.size ()) < unused)
-		mvaddwstr (LINES - 2, COLS - pos.size (), pos.c_str ());
+	auto mode = decode_mode (e.mode);
+	if (e.acl)
+		mode += L"+";
+	r.cols[entry::MODES] = apply_attrs (mode, 0);
+	r.cols[entry::USER] = apply_attrs (format_user (e.uid), 0);
+	r.cols[entry::GROUP] = apply_attrs (format_group (e.gid), 0);
+	r.cols[entry::SIZE] = apply_attrs (format_size (e.total_size ()), 0);
+	r.cols[entry::MTIME] = apply_attrs (format_mtime (e.mtime), 0);
+
+	auto &fn = r.cols[entry::FILENAME] =
+		apply_attrs (to_wide (e.filename ()), e.name_attrs);
+	if (e.target) {
+		fn += apply_attrs (L" -> ", 0);
+		fn += apply_attrs (to_wide (e.target_path ()), e.target_attrs);
+	}
+	return r;
+}
 
-	attrset (g.attrs[g.AT_INPUT]);
-	curs_set (0);
-	if (g.editor) {
-		move (LINES - 1, 0);
-		auto prompt = apply_attrs (wstring (g.editor) + L": ", 0),
-			line = apply_attrs (g.editor_line, 0),
-			info = apply_attrs (g.editor_info, g.attrs[g.AT_INFO]);
+/// Return formatted columns of an entry, valid until the next call
+fun row_of (const entry &e) -> const row & {
+	auto i = g.rows.find (e.name);
+	if (i != g.rows.end ())
+		return i->second;
 
-		auto info_width = compute_width (info);
-		if (print (prompt + line, COLS - 1) < COLS - info_width) {
-			move (LINES - 1, COLS - info_width);
+	// It only needs to hold about a screenful, so keep it simple
+	if (g.rows.size () >= 1024)
+		g.rows.clear ();
+	return g.rows[e.name] = make_row (e);
+}
+
+fun compute_width (const wstring &w) -> int {
+	int total = 0;
+	for (auto c : w)
+		total += wcwidth (c);
+	return total;
+}
+
+/// Compute the width of a column as it would be formatted, only cheaper
+fun column_width (const entry &e, int col) -> int {
+	// Like GNU ls, assume that all months may be of the longest width
+	static int mtime_width = [] {
+		int longest = 0;
+		struct tm tm {};
+		for (tm.tm_mon = 0; tm.tm_mon < 12; tm.tm_mon++) {
+			wchar_t buf[32] = L"";
+			wcsftime (buf, sizeof buf / sizeof *buf, L"%b %e %H:%M", &tm);
+			longest = max (longest, compute_width (buf));
+		}
+		return longest;
+	} ();
+
+	if (e.failed && col != entry::MODES)
+		return 1;
+
+	switch (col) {
+	case entry::MODES:
+		return 10 + e.acl;
+	case entry::USER:
+		return compute_width (format_user (e.uid));
+	case entry::GROUP:
+		return compute_width (format_group (e.gid));
+	case entry::SIZE:
+		return format_size (e.total_size ()).length ();
+	case entry::MTIME:
+		return mtime_width;
+	}
+	return 0;
+}
+
+/// Account for an entry in column widths.  Filenames come last, and need not
+/// be aligned, so measuring them is left to update_listing() on demand.
+fun widen_columns (const entry &e) {
+	for (int col = 0; col < entry::FILENAME; col++)
+		g.max_widths[col] = max (g.max_widths[col], column_width (e, col));
+}
+
+#ifdef HAVE_LIBURING
+struct uring_request {
+	const char *path;                   ///< Path relative to the directory
+	struct stat *info;                  ///< Where to store the results
+	bool ok;                            ///< Whether it has succeeded
+};
+
+/// Run statx() for all requests in batches, so that the kernel can process
+/// them asynchronously.  Returns false if io_uring turns out to be unusable.
+fun uring_statx (int dir, vector<uring_request> &requests, int flags,
+	unsigned mask) -> bool {
+	// The kernel or a seccomp policy may refuse our request,
+	// in which case we just keep using the synchronous path
+	const unsigned depth = 256;
+	static io_uring ring;
+	static int ring_status = io_uring_queue_init (depth, &ring, 0);
+	if (ring_status < 0)
+		return false;
+
+	struct statx buffers[depth];
+	for (size_t i = 0; i < requests.size (); ) {
+		size_t batch = 0;
+		for (; batch < depth && i + batch < requests.size (); batch++) {
+			auto sqe = io_uring_get_sqe (&ring);
+			if (!sqe)
+				break;
+
+			auto &request = requests[i + batch];
+			buffers[batch] = {};
+			io_uring_prep_statx (sqe, dir, request.path, flags, mask,
+				&buffers[batch]);
+			io_uring_sqe_set_data (sqe, &request);
+		}
+
+		int submitted = io_uring_submit_and_wait (&ring, batch);
+		for (int k = 0; k < submitted; k++) {
+			io_uring_cqe *cqe = nullptr;
+			if ((ring_status = io_uring_wait_cqe (&ring, &cqe)) < 0)
+				break;
+
+			auto request = (uring_request *) io_uring_cqe_get_data (cqe);
+			const auto &x = buffers[request - &requests[i]];
+			if (cqe->res == -EINVAL)
+				ring_status = cqe->res;  // IORING_OP_STATX is not supported
+			if ((request->ok = !cqe->res)) {
+				auto &info = *request->info;
+				info.st_dev = makedev (x.stx_dev_major, x.stx_dev_minor);
+				info.st_ino = x.stx_ino;
+				info.st_mode = x.stx_mode;
+				info.st_nlink = x.stx_nlink;
+				info.st_uid = x.stx_uid;
+				info.st_gid = x.stx_gid;
+				info.st_size = x.stx_size;
+				info.st_mtim.tv_sec = x.stx_mtime.tv_sec;
+				info.st_mtim.tv_nsec = x.stx_mtime.tv_nsec;
+			}
+			io_uring_cqe_seen (&ring, cqe);
+		}
+		if (submitted < int (batch) || ring_status < 0) {
+			io_uring_queue_exit (&ring);
+			return ring_status = -1, false;
+		}
+		i += batch;
+	}
+	return true;
+}
+
+/// Retrieve metadata through io_uring, only asking for what will be shown
+/// when it is to be the thin view.  Returns false if it's not available.
+fun uring_stat (int dir, const entry *entries, metadata *meta, size_t count)
+	-> bool {
+	unsigned mask = STATX_TYPE | STATX_MODE | STATX_NLINK;
+	if (g.full_view || g.sort_column == entry::MODES)
+		mask |= STATX_BASIC_STATS;
+	else if (g.sort_column == entry::USER)
+		mask |= STATX_UID;
+	else if (g.sort_column == entry::GROUP)
+		mask |= STATX_GID;
+	else if (g.sort_column == entry::SIZE)
+		mask |= STATX_SIZE;
+	else if (g.sort_column == entry::MTIME)
+		mask |= STATX_MTIME;
+
+	vector<uring_request> requests;
+	for (size_t i = 0; i < count; i++)
+		requests.push_back ({entries[i].filename (), &meta[i].info});
+	if (!uring_statx (dir, requests, AT_SYMLINK_NOFOLLOW, mask))
+		return false;
+
+	// Following symlinks with statx() itself spares us readlink() here
+	vector<uring_request> targets;
+	for (size_t i = 0; i < count; i++)
+		if (S_ISLNK (meta[i].info.st_mode))
+			targets.push_back ({entries[i].filename (), &meta[i].target_info});
+	if (!uring_statx (dir, targets, 0, mask))
+		return false;
+
+	if ((mask & STATX_BASIC_STATS) != STATX_BASIC_STATS)
+		g.partial_info = true;
+	for (size_t i = 0; i < count; i++)
+		meta[i].have_info = requests[i].ok;
+	return true;
+}
+#endif
+
+fun inline visible_lines () -> int { return max (0, LINES - 2); }
+
+/// Make the next update() redraw everything
+fun invalidate () {
+	g.painted.clear ();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+// Line starts are only ever found around the current position, so that
+// even huge files open instantly.  memchr() tends to be vectorized.
+
+/// Return the offset of the line containing `offset`
+fun viewer_start (size_t offset) -> size_t {
+	auto nl = (const char *) memrchr (g.view.data, '\n', offset);
+	return nl ? nl - g.view.data + 1 : 0;
+}
+
+/// Return the offset of the line following the one at `offset`
+fun viewer_next (size_t offset) -> size_t {
+	const auto &v = g.view;
+	auto nl = (const char *) memchr (v.data + offset, '\n', v.size - offset);
+	return nl ? nl - v.data + 1 : v.size;
+}
+
+/// Return the offset of the line preceding the one at `offset`
+fun viewer_previous (size_t offset) -> size_t {
+	return offset ? viewer_start (offset - 1) : 0;
+}
+
+/// Return the offset of the last line that may be shown at the top
+fun viewer_bottom () -> size_t {
+	auto &v = g.view;
+	if (v.bottom_rows != visible_lines ()) {
+		v.bottom_rows = visible_lines ();
+		v.bottom = v.size;
+		for (int i = 0; i < v.bottom_rows && v.bottom; i++)
+			v.bottom = viewer_previous (v.bottom);
+	}
+	return v.bottom;
+}
+
+fun viewer_scroll (int count) {
+	auto &v = g.view;
+	for (; count < 0 && v.top; count++)
+		v.top = viewer_previous (v.top);
+	for (auto bottom = viewer_bottom (); count > 0 && v.top < bottom; count--)
+		v.top = viewer_next (v.top);
+}
+
+/// Format as much of a line of text as would fit `width` cells from
+/// `column`, interpreting overstriking the way less(1) does,
+/// and highlighting any occurrences of `needle`
+fun format_text (const char *data, size_t offset, size_t end, int column,
+	int width, const string &needle = "") -> ncstring {
+	ncstring out;
+	int used = 0, limit = column + width;
+	auto emit = [&](const ncstring &cells) {
+		for (auto c : cells) {
+			int w = max (0, wcwidth (c.chars[0]));
+			if (used >= column)
+				out.push_back (c);
+			else if (used + w > column)
+				out.insert (out.end (), used + w - column, cchar (0, L' '));
+			used += w;
+		}
+	};
+
+	mbstate_t mb {};
+	auto decode = [&](size_t &p, wchar_t &w) -> bool {
+		auto n = mbrtowc (&w, data + p, end - p, &mb);
+		if (n == size_t (-1) || n == size_t (-2)) {
+			mb = {};
+			p++;
+			return false;
+		}
+		p += max<size_t> (n, 1);
+		return true;
+	};
+
+	// Matches are marked from wherever they start
+	auto match = end, match_end = end;
+	auto find_match = [&](size_t from) {
+		auto found = needle.empty () ? nullptr : (const char *) memmem
+			(data + from, end - from, needle.data (), needle.size ());
+		match = found ? found - data : end;
+		match_end = match + needle.size ();
+	};
+	find_match (offset);
+
+	for (auto p = offset; p < end && used < limit; ) {
+		if (p >= match_end)
+			find_match (match_end);
+
+		chtype attrs = match <= p && p < match_end ? A_REVERSE : 0;
+		wchar_t c {};
+		if (!decode (p, c)) {
+			emit ({cchar (attrs | A_REVERSE, L'?')});
+			continue;
+		}
+		if (c == L'\t') {
+			emit (apply_attrs (wstring (8 - used % 8, L' '), attrs));
+			continue;
+		}
+
+		wchar_t over {};
+		auto q = p + 1;
+		if (q < end && data[p] == '\b' && decode (q, over) && over != L'\b') {
+			if (c == L'_' && over != L'_')
+				attrs |= A_UNDERLINE, c = over;
+			else if (over == L'_' && c != L'_')
+				attrs |= A_UNDERLINE;
+			else if (c == over)
+				attrs |= A_BOLD;
+			else
+				c = over;
+			p = q;
+		}
+		emit (sanitize_char (attrs, c));
+	}
+	return out;
+}
+
+fun viewer_draw () {
+	const auto &v = g.view;
+	auto offset = v.top;
+	for (int y = 0; y < visible_lines (); y++) {
+		move (y, 0);
+		attrset (0);
+		if (offset >= v.size) {
+			clrtoeol ();
+			continue;
+		}
+
+		auto next = viewer_next (offset), end = next;
+		if (end > offset && v.data[end - 1] == '\n')
+			end--;
+		if (end > offset && v.data[end - 1] == '\r')
+			end--;
+		auto line = format_text (v.data, offset, end, v.column, COLS, v.needle);
+		hline (' ', COLS - print (line, COLS));
+		offset = next;
+	}
+
+	// Only in between are we sure not to divide by zero
+	wstring pos;
+	if (!viewer_bottom ())
+		pos = L"All";
+	else if (!v.top)
+		pos = L"Top";
+	else if (v.top >= viewer_bottom ())
+		pos = L"Bot";
+	else
+		pos = to_wstring (int (double (v.top) / v.size * 100)) + L"%";
+
+	move (LINES - 2, 0);
+	attrset (g.attrs[g.AT_BAR]);
+	int unused = COLS -
+		print (apply_attrs (to_wide (v.title), g.attrs[g.AT_CWD]), COLS);
+	hline (' ', unused);
+	if (int (pos.size ()) < unused)
+		mvaddwstr (LINES - 2, COLS - pos.size (), pos.c_str ());
+}
+
+fun viewer_close () {
+	auto &v = g.view;
+	if (v.mapped)
+		munmap ((void *) v.data, v.size);
+	v.text.clear ();
+	v.data = nullptr;
+	v.size = 0;
+	v.mapped = false;
+	v.truncated = false;
+	invalidate ();
+}
+
+/// Accessing the mapping of a file beyond its new end after it has been
+/// truncated raises SIGBUS.  Replace the whole mapping with zeroes then,
+/// so that the access can go on, and have the viewer closed once it's over.
+fun viewer_sigbus (int signum, siginfo_t *info, void *) {
+	auto &v = g.view;
+	auto addr = (const char *) info->si_addr;
+	if (v.mapped && addr >= v.data && addr < v.data + v.size
+	 && mmap ((void *) v.data, v.size, PROT_READ,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+		v.truncated = true;
+		return;
+	}
+
+	// Anything else is a genuine fault, so let it take its usual course
+	signal (signum, SIG_DFL);
+}
+
+/// How much of the terminal's width the listing takes up
+fun listing_width () -> int {
+	return g.show_preview ? COLS / 2 : COLS;
+}
+
+fun update_listing () {
+	int start_column = g.full_view ? 0 : entry::FILENAME;
+	static int alignment[entry::COLUMNS] = {-1, -1, -1, 1, 1, -1};
+
+	int available = visible_lines ();
+	int all = g.entries.size ();
+	int used = min (available, all - g.offset);
+	int width = listing_width ();
+	int top = g.offset - (g.gravity ? available - used : 0);
+	if (int (g.painted.size ()) != available || g.painted_cols != width) {
+		g.painted.assign (available, {});
+		g.painted_cols = width;
+		g.painted_top = top;
+		g.painted_bar = {};
+	}
+
+	// Scrolling moves what has been drawn along with it,
+	// so that only newly exposed lines need to be formatted and printed
+	int shift = top - g.painted_top;
+	g.painted_top = top;
+	if (shift && abs (shift) < available) {
+		if (shift > 0) {
+			g.painted.erase (g.painted.begin (), g.painted.begin () + shift);
+			g.painted.resize (available);
+		} else {
+			g.painted.erase (g.painted.end () + shift, g.painted.end ());
+			g.painted.insert (g.painted.begin (), -shift, painted_line {});
+		}
+
+		// Printing up to the bottom right corner mustn't scroll, though
+		scrollok (stdscr, TRUE);
+		setscrreg (0, available - 1);
+		scrl (shift);
+		setscrreg (0, LINES - 1);
+		scrollok (stdscr, FALSE);
+	}
+
+	// Filenames only need padding to flash as a column, and measuring
+	// the visible ones is enough for that, regardless of the listing's size
+	int widths[entry::COLUMNS] = {};
+	copy (begin (g.max_widths), end (g.max_widths), widths);
+	bool flash = g.sort_flash_until;
+	if (flash && g.sort_column == entry::FILENAME) {
+		for (int i = 0; i < used; i++) {
+			const auto &r = row_of (g.entries[g.offset + i]);
+			widths[entry::FILENAME] = max (widths[entry::FILENAME],
+				compute_width (r.cols[entry::FILENAME]));
+		}
+		widths[entry::FILENAME] = min (widths[entry::FILENAME], width);
+	}
+
+	// Only redraw lines that would come out differently,
+	// which is typically just two of them as the cursor moves
+	for (int y = 0; y < available; y++) {
+		auto i = g.gravity ? y - (available - used) : y;
+		painted_line line {0, 0, 0};
+		if (i < 0 || i >= used) {
+			if (!(line == g.painted[y])) {
+				move (y, 0);
+				attrset (0);
+				hline (' ', width);
+			}
+			g.painted[y] = line;
+			continue;
+		}
+
+		auto index = g.offset + i;
+		bool cursored = index == g.cursor;
+		bool selected = g.entries[index].selected;
+		line.version = g.entries_version;
+		line.name = g.entries[index].name;
+		line.state = cursored | selected << 1 | flash << 2
+			| start_column << 3 | g.sort_column << 6
+			| widths[entry::FILENAME] << 9;
+		if (line == g.painted[y])
+			continue;
+		g.painted[y] = line;
+
+		chtype attrs {};
+		if (selected)
+			attrs = g.attrs[g.AT_SELECT];
+		if (cursored)
+			attrs = g.attrs[g.AT_CURSOR] | (attrs & ~A_COLOR);
+		attrset (attrs);
+
+		move (y, 0);
+
+		auto used = 0;
+		for (int col = start_column; col < entry::COLUMNS; col++) {
+			const auto &field = row_of (g.entries[index]).cols[col];
+			auto aligned = align (field, alignment[col] * widths[col]);
+			if (cursored || selected)
+				for_each (begin (aligned), end (aligned), decolor);
+			if (g.sort_flash_until && col == g.sort_column)
+				for_each (begin (aligned), end (aligned), invert);
+			used += print (aligned + apply_attrs (L" ", 0), width - used);
+		}
+		hline (' ', width - used);
+	}
+
+	auto pos = to_wstring (int (double (g.offset) / all * 100)) + L"%";
+	if (used == all)
+		pos = L"All";
+	else if (g.offset == 0)
+		pos = L"Top";
+	else if (g.offset + used == all)
+		pos = L"Bot";
+
+	auto bar_state = make_tuple (g.cwd, g.show_hidden, g.out_of_date,
+		g.truncated, g.loading ? all : -1, pos);
+	if (bar_state != g.painted_bar) {
+		g.painted_bar = bar_state;
+
+		auto bar = apply_attrs (to_wide (g.cwd), g.attrs[g.AT_CWD]);
+		if (!g.show_hidden)
+			bar += apply_attrs (L" (hidden)", 0);
+		if (g.out_of_date)
+			bar += apply_attrs (L" [+]", 0);
+		if (g.truncated)
+			bar += apply_attrs (L" [truncated]", 0);
+		if (g.loading)
+			bar += apply_attrs (L" [" + to_wstring (all) + L"...]", 0);
+
+		move (LINES - 2, 0);
+		attrset (g.attrs[g.AT_BAR]);
+		int unused = COLS - print (bar, COLS);
+		hline (' ', unused);
+
+		if (int (pos.size ()) < unused)
+			mvaddwstr (LINES - 2, COLS - pos.size (), pos.c_str ());
+	}
+}
+
+/// Check whether a preview has been made of a particular entry version
+fun preview_matches (const preview &p, const entry &e) -> bool {
+	// The name is there for when the listing lacks inode numbers
+	return p.dev == e.dev && p.ino == e.ino && p.mtime == e.mtime
+		&& p.show_hidden == g.show_hidden && p.cwd == g.cwd
+		&& p.name == e.filename ();
+}
+
+/// Find a finished preview of an entry, and mark it as recently used
+fun preview_of (const entry &e) -> shared_ptr<preview> {
+	for (auto i = g.previews.begin (); i != g.previews.end (); i++) {
+		if (preview_matches (**i, e)) {
+			g.previews.splice (g.previews.begin (), g.previews, i);
+			return g.previews.front ();
+		}
+	}
+	return nullptr;
+}
+
+/// Draw the preview pane to the right of the listing
+fun update_preview () {
+	int x = listing_width (), width = max (0, COLS - x - 1);
+	shared_ptr<preview> p;
+	if (g.cursor >= 0 && g.cursor < int (g.entries.size ()))
+		p = preview_of (g.entries[g.cursor]);
+
+	attrset (0);
+	mvvline (0, x, ACS_VLINE, visible_lines ());
+	size_t offset = 0;
+	for (int y = 0; y < visible_lines (); y++) {
+		move (y, x + 1);
+		attrset (0);
+
+		ncstring line;
+		if (p && offset < p->text.size ()) {
+			auto data = p->text.data ();
+			auto nl = (const char *) memchr
+				(data + offset, '\n', p->text.size () - offset);
+			auto end = nl ? nl - data : p->text.size ();
+			auto next = nl ? end + 1 : end;
+			if (end > offset && data[end - 1] == '\r')
+				end--;
+			line = format_text (data, offset, end, 0, width);
+			offset = next;
+		} else if (p && !y && p->text.empty ()) {
+			line = apply_attrs (to_wide (p->note), g.attrs[g.AT_INFO]);
+		}
+		hline (' ', width - print (line, width));
+	}
+}
+
+fun show_message (const string &message, int ttl_ms = 3000) {
+	g.message = to_wide (message);
+	g.message_until = monotonic_ts_ms () + ttl_ms;
+}
+
+fun update () {
+	TRACE (DRAW);
+	if (g.view.data)
+		viewer_draw ();
+
+	// Only drawing would have shown that the file has been truncated,
+	// and what has been drawn is useless then
+	if (g.view.truncated) {
+		viewer_close ();
+		show_message ("the file has been truncated");
+	}
+	if (!g.view.data) {
+		update_listing ();
+		if (g.show_preview)
+			update_preview ();
+	}
+
+	attrset (g.attrs[g.AT_INPUT]);
+	curs_set (0);
+	move (LINES - 1, 0);
+	clrtoeol ();
+	if (g.editor) {
+		move (LINES - 1, 0);
+		auto prompt = apply_attrs (wstring (g.editor) + L": ", 0),
+			line = apply_attrs (g.editor_line, 0),
+			info = apply_attrs (g.editor_info, g.attrs[g.AT_INFO]);
+
+		auto info_width = compute_width (info);
+		if (print (prompt + line, COLS - 1) < COLS - info_width) {
+			move (LINES - 1, COLS - info_width);
 			print (info, info_width);
 		}
 
@@ -855,15 +2207,11 @@ fun update () {
 	} else if (!g.message.empty ()) {
 		move (LINES - 1, 0);
 		print (apply_attrs (g.message, 0), COLS);
-	} else if (!g.selection.empty ()) {
-		uint64_t size = 0;
-		for (const auto &e : g.entries)
-			if (g.selection.count (e.filename)
-			 && S_ISREG (e.info.st_mode) && e.info.st_size > 0)
-				size += e.info.st_size;
-
+	} else if (g.view.data) {
+		// The listing's status would be out of place
+	} else if (g.selected) {
 		wostringstream status;
-		status << size << L" bytes in " << g.selection.size () << L" items";
+		status << g.selected_size << L" bytes in " << g.selected << L" items";
 		move (LINES - 1, 0);
 		print (apply_attrs (status.str (), g.attrs[g.AT_SELECT]), COLS);
 	} else if (!g.cmdline.empty ()) {
@@ -874,40 +2222,86 @@ fun update () {
 	refresh ();
 }
 
-fun operator< (const entry &e1, const entry &e2) -> bool {
-	static string dotdot {".."};
-	auto t1 = make_tuple (e1.filename != dotdot,
-		!S_ISDIR (e1.info.st_mode) && !S_ISDIR (e1.target_info.st_mode));
-	auto t2 = make_tuple (e2.filename != dotdot,
-		!S_ISDIR (e2.info.st_mode) && !S_ISDIR (e2.target_info.st_mode));
-	if (t1 != t2)
-		return t1 < t2;
-
-	const auto &a = g.reverse_sort ? e2 : e1;
-	const auto &b = g.reverse_sort ? e1 : e2;
+/// Everything needed to order an entry, packed so that most comparisons
+/// only have to look at some integers
+struct sort_key {
+	uint64_t primary;                   ///< Column value, or a name prefix
+	const char *collated;               ///< First tie breaker
+	const char *name;                   ///< Last tie breaker
+	uint32_t index;                     ///< Position within g.entries
+	uint8_t group;                      ///< "..", directories, the rest
+};
+
+/// Map a signed value to an unsigned one while preserving its order
+template<typename T> fun sort_order (T value) -> uint64_t {
+	return uint64_t (int64_t (value)) ^ (uint64_t (1) << 63);
+}
+
+fun make_sort_key (const entry &e, uint32_t index) -> sort_key {
+	sort_key key {0, e.sort_name (), e.filename (), index, 0};
+	if (strcmp (key.name, ".."))
+		key.group = 1 + (!S_ISDIR (e.mode) && !S_ISDIR (e.target_mode));
+
 	switch (g.sort_column) {
-	case entry::MODES:
-		if (a.info.st_mode != b.info.st_mode)
-			return a.info.st_mode < b.info.st_mode;
-		break;
-	case entry::USER:
-		if (a.info.st_uid != b.info.st_uid)
-			return a.info.st_uid < b.info.st_uid;
-		break;
-	case entry::GROUP:
-		if (a.info.st_gid != b.info.st_gid)
-			return a.info.st_gid < b.info.st_gid;
-		break;
-	case entry::SIZE:
-		if (a.info.st_size != b.info.st_size)
-			return a.info.st_size < b.info.st_size;
-		break;
-	case entry::MTIME:
-		if (a.info.st_mtime != b.info.st_mtime)
-			return a.info.st_mtime < b.info.st_mtime;
-		break;
+	case entry::MODES: key.primary = e.mode;              break;
+	case entry::USER:  key.primary = e.uid;               break;
+	case entry::GROUP: key.primary = e.gid;               break;
+	case entry::SIZE:  key.primary = sort_order (e.total_size ()); break;
+	case entry::MTIME: key.primary = sort_order (e.mtime); break;
+	default:
+		// Big-endian, so that it orders the same as strcmp() does
+		for (int i = 0; i < 8 && key.collated[i]; i++)
+			key.primary |= uint64_t (uint8_t (key.collated[i])) << (56 - 8 * i);
+	}
+	if (g.reverse_sort)
+		key.primary = ~key.primary;
+	return key;
+}
+
+fun operator< (const sort_key &a, const sort_key &b) -> bool {
+	if (a.group != b.group)
+		return a.group < b.group;
+	if (a.primary != b.primary)
+		return a.primary < b.primary;
+
+	auto order = strcmp (a.collated, b.collated);
+	if (!order)
+		order = strcmp (a.name, b.name);
+	return g.reverse_sort ? order > 0 : order < 0;
+}
+
+fun operator< (const entry &e1, const entry &e2) -> bool {
+	return make_sort_key (e1, 0) < make_sort_key (e2, 0);
+}
+
+/// Sort keys, splitting the work across the pool when there are many
+fun sort_keys (vector<sort_key> &keys) {
+	// Below this, threads only add overhead
+	const size_t threshold = 1 << 15;
+	size_t runs = min (pool_size (), keys.size () / threshold);
+	if (runs < 2) {
+		sort (begin (keys), end (keys));
+		return;
+	}
+
+	vector<size_t> bounds;
+	for (size_t i = 0; i <= runs; i++)
+		bounds.push_back (keys.size () * i / runs);
+	pool_for (runs, [&](size_t i) {
+		sort (begin (keys) + bounds[i], begin (keys) + bounds[i + 1]);
+	}, 0);
+
+	// Merge neighbouring runs pairwise until only one remains
+	for (size_t step = 1; step < runs; step *= 2) {
+		auto merges = (runs + 2 * step - 1) / (2 * step);
+		pool_for (merges, [&](size_t i) {
+			auto first = i * 2 * step, middle = first + step,
+				last = min (runs, middle + step);
+			if (middle < runs)
+				inplace_merge (begin (keys) + bounds[first],
+					begin (keys) + bounds[middle], begin (keys) + bounds[last]);
+		}, 0);
 	}
-	return a.filename < b.filename;
 }
 
 fun at_cursor () -> const entry & {
@@ -915,143 +2309,929 @@ fun at_cursor () -> const entry & {
 	return g.cursor >= int (g.entries.size ()) ? invalid : g.entries[g.cursor];
 }
 
+/// Return entry indexes ordered bytewise by name, for binary searching
+fun search_index () -> const vector<uint32_t> & {
+	if (g.by_name_version != g.entries_version) {
+		g.by_name.resize (g.entries.size ());
+		iota (begin (g.by_name), end (g.by_name), 0);
+		sort (begin (g.by_name), end (g.by_name), [](uint32_t a, uint32_t b) {
+			const auto &entries = g.entries;
+			return strcmp (entries[a].filename (), entries[b].filename ()) < 0;
+		});
+		g.by_name_version = g.entries_version;
+	}
+	return g.by_name;
+}
+
 fun focus (const string &anchor) {
-	if (!anchor.empty ()) {
-		for (size_t i = 0; i < g.entries.size (); i++)
-			if (g.entries[i].filename == anchor)
-				g.cursor = i;
+	if (g.loading && !anchor.empty ())
+		g.load_anchor = anchor;
+	if (anchor.empty ())
+		return;
+
+	// Building the index would cost more than a single pass over entries,
+	// which is only made once per reload or resort.  Once lookup() has built
+	// the index, resort() keeps it current, until the next reload.
+	const auto &entries = g.entries;
+	if (g.by_name_version == g.entries_version) {
+		const auto &index = g.by_name;
+		auto i = partition_point (begin (index), end (index),
+			[&](uint32_t k) { return entries[k].filename () < anchor; });
+		if (i != end (index) && entries[*i].filename () == anchor)
+			g.cursor = *i;
+		return;
+	}
+	for (size_t i = 0; i < entries.size (); i++)
+		if (entries[i].filename () == anchor) {
+			g.cursor = i;
+			break;
+		}
+}
+
+/// Find the part of search_index() whose names begin with `prefix`
+fun search_range (const string &prefix)
+	-> pair<const uint32_t *, const uint32_t *> {
+	auto compare = [&](uint32_t i) {
+		auto name = g.entries[i].filename ();
+		return strncmp (name, prefix.c_str (), prefix.size ());
+	};
+	const auto &index = search_index ();
+	auto end = index.data () + index.size ();
+	auto first = partition_point (index.data (), end,
+		[&](uint32_t i) { return compare (i) < 0; });
+	auto last = partition_point (first, end,
+		[&](uint32_t i) { return compare (i) == 0; });
+	return {first, last};
+}
+
+/// Stays on the current item unless there are better matches
+fun lookup (const wstring &needle) {
+	const auto &index = search_index ();
+	auto mb = to_mb (needle);
+	auto position = partition_point (begin (index), end (index),
+		[&](uint32_t i) { return g.entries[i].filename () < mb; });
+
+	// The longest shared prefix is to be found right around that position
+	size_t best_n = 0;
+	if (position != end (index))
+		best_n = prefix_length (to_wide (g.entries[*position].filename ()),
+			needle);
+	if (position != begin (index))
+		best_n = max (best_n, prefix_length (
+			to_wide (g.entries[*(position - 1)].filename ()), needle));
+	if (!best_n)
+		return;
+
+	// Prefer the first such entry at or after the cursor
+	int count = index.size (), best = g.cursor, best_distance = count;
+	auto range = search_range (to_mb (needle.substr (0, best_n)));
+	for (auto i = range.first; i != range.second; i++) {
+		int distance = (int (*i) - g.cursor + count) % count;
+		if (distance < best_distance) {
+			best = *i;
+			best_distance = distance;
+		}
 	}
+	g.cursor = best;
 }
 
-fun resort (const string anchor = at_cursor ().filename) {
-	sort (begin (g.entries), end (g.entries));
+/// Put entries in the order of sorted keys, keeping the cursor at the anchor
+fun resort_apply (const vector<sort_key> &keys, const string &anchor) {
+	vector<entry> sorted;
+	sorted.reserve (keys.size ());
+	for (const auto &key : keys)
+		sorted.push_back (g.entries[key.index]);
+	g.entries = move (sorted);
+
+	// The name index only needs to follow entries to their new places
+	bool indexed = g.by_name_version == g.entries_version;
+	g.entries_version++;
+	if (indexed) {
+		vector<uint32_t> moved_to (keys.size ());
+		for (size_t i = 0; i < keys.size (); i++)
+			moved_to[keys[i].index] = i;
+		for (auto &i : g.by_name)
+			i = moved_to[i];
+		g.by_name_version = g.entries_version;
+	}
 	focus (anchor);
 }
 
-fun show_message (const string &message, int ttl = 30) {
-	g.message = to_wide (message);
-	g.message_ttl = ttl;
+fun resort (const string anchor = at_cursor ().filename ()) {
+	TRACE (SORT);
+	// Sorting keys moves a lot less memory around than sorting entries,
+	// and spares comparisons from decoding them over and over again
+	vector<sort_key> keys;
+	keys.reserve (g.entries.size ());
+	for (size_t i = 0; i < g.entries.size (); i++)
+		keys.push_back (make_sort_key (g.entries[i], i));
+	sort_keys (keys);
+	resort_apply (keys, anchor);
 }
 
-fun filter_selection (const set<string> &selection) {
-	set<string> reselection;
-	if (!selection.empty ())
+/// Sort entries that have been appended to an already sorted listing,
+/// merging them in, rather than sorting the whole listing all over again
+fun resort_appended (size_t sorted,
+	const string anchor = at_cursor ().filename ()) {
+	TRACE (SORT);
+	vector<sort_key> keys, added;
+	keys.reserve (g.entries.size ());
+	for (size_t i = 0; i < sorted; i++)
+		keys.push_back (make_sort_key (g.entries[i], i));
+	for (size_t i = sorted; i < g.entries.size (); i++)
+		added.push_back (make_sort_key (g.entries[i], i));
+	sort_keys (added);
+	keys.insert (keys.end (), added.begin (), added.end ());
+	inplace_merge (keys.begin (), keys.begin () + sorted, keys.end ());
+	resort_apply (keys, anchor);
+}
+
+/// Return how much an entry adds to the total size of the selection
+fun selection_weight (const entry &e) -> uint64_t {
+	return (S_ISREG (e.mode) || du_lookup (e)) && e.size > 0
+		? e.total_size () : 0;
+}
+
+/// Change whether an entry is selected, keeping count
+fun set_selected (entry &e, bool selected) {
+	if (e.selected == selected)
+		return;
+	if ((e.selected = selected)) {
+		g.selected++;
+		g.selected_size += selection_weight (e);
+	} else {
+		g.selected--;
+		g.selected_size -= selection_weight (e);
+	}
+}
+
+/// Count selected entries anew, such as when their sizes may have changed
+fun selection_recount () {
+	g.selected = g.selected_size = 0;
+	for (const auto &e : g.entries)
+		if (e.selected) {
+			g.selected++;
+			g.selected_size += selection_weight (e);
+		}
+}
+
+fun selection_clear () {
+	for (auto &e : g.entries)
+		e.selected = false;
+	g.selected = g.selected_size = 0;
+	g.reselect.clear ();
+}
+
+/// Return filenames of selected entries, including those yet to be loaded
+fun selection_names () -> set<string> {
+	auto names = g.reselect;
+	if (g.selected)
 		for (const auto &e : g.entries)
-			if (selection.count (e.filename))
-				reselection.insert (e.filename);
-	return reselection;
+			if (e.selected)
+				names.insert (e.filename ());
+	return names;
 }
 
-fun reload (bool keep_anchor) {
-	g.unames.clear ();
-	while (auto *ent = getpwent ())
-		g.unames.emplace (ent->pw_uid, to_wide (ent->pw_name));
-	endpwent ();
+/// Replace the selection with entries of the given names,
+/// some of which may only appear as the directory is being loaded
+fun selection_restore (set<string> names) {
+	for (auto &e : g.entries) {
+		auto i = names.empty () ? names.end () : names.find (e.filename ());
+		if ((e.selected = i != names.end ()))
+			names.erase (i);
+	}
+	selection_recount ();
+	if (g.loading)
+		g.reselect = move (names);
+	else
+		g.reselect.clear ();
+}
 
-	g.gnames.clear ();
-	while (auto *ent = getgrent ())
-		g.gnames.emplace (ent->gr_gid, to_wide (ent->gr_name));
-	endgrent ();
+/// Drop names that no entry refers to anymore
+fun compact_names () {
+	string names (1, 0);
+	auto move_name = [&](size_t &offset) {
+		if (offset) {
+			auto name = g.names.c_str () + offset;
+			offset = names.size ();
+			names.append (name, strlen (name) + 1);
+		}
+	};
+	for (auto &e : g.entries) {
+		move_name (e.name);
+		move_name (e.target);
+		move_name (e.collated);
+	}
+	g.names = move (names);
+	g.names_garbage = 0;
+	g.rows.clear ();
+}
 
-	string anchor;
-	if (keep_anchor)
-		anchor = at_cursor ().filename;
+/// Recompute name sort keys after the sort mode has changed
+fun recollate () {
+	vector<string> keys (g.entries.size ());
+	pool_for (keys.size (), [&](size_t i) {
+		keys[i] = collation_key (g.entries[i].filename (), g.sort_mode);
+	});
+	for (size_t i = 0; i < keys.size (); i++) {
+		auto &e = g.entries[i];
+		release (e.collated);
+		e.collated = keys[i].empty () ? 0 : intern (keys[i].c_str ());
+	}
+	if (g.names_garbage > g.names.size () / 2)
+		compact_names ();
+}
 
-	auto now = time (NULL); g.now = *localtime (&now);
-	auto dir = opendir (".");
-	g.entries.clear ();
-	if (!dir) {
-		show_message (strerror (errno));
-		if (g.cwd != "/") {
-			struct dirent f = {};
-			strncpy (f.d_name, "..", sizeof f.d_name);
-			f.d_type = DT_DIR;
-			g.entries.push_back (make_entry (&f));
+#ifdef __linux__
+fun watch_add (const char *path) -> int {
+	// We don't show atime, so access, open and close are merely spam
+	return inotify_add_watch (g.watch_fd, path,
+		IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+		IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF |
+		IN_ONLYDIR | IN_EXCL_UNLINK);
+}
+
+/// Check whether a watch descriptor, which may be shared, has an owner
+fun watch_in_use (int wd) -> bool {
+	return wd == g.watch_wd || any_of (begin (g.listings), end (g.listings),
+		[=](const listing &l) { return l.wd == wd; });
+}
+#endif
+
+fun watch_directory () {
+#ifdef __linux__
+	if (g.watch_wd != -1)
+		inotify_rm_watch (g.watch_fd, g.watch_wd);
+
+	g.watch_wd = watch_add (".");
+
+	// The same directory may be reachable through multiple paths,
+	// and inotify then hands out the same watch descriptor
+	for (auto i = g.listings.begin (); i != g.listings.end (); )
+		if (g.watch_wd != -1 && i->wd == g.watch_wd) {
+			g.listings_size -= i->size ();
+			i = g.listings.erase (i);
+		} else {
+			i++;
 		}
-		goto readfail;
+#elif !defined __CYGWIN__
+	if (g.watch_wd != -1)
+		close (g.watch_wd);
+
+	if ((g.watch_wd = open (".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+		// At least the macOS kqueue doesn't report anything too specific
+		struct kevent ev {};
+		EV_SET (&ev, g.watch_wd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+			NOTE_WRITE | NOTE_LINK, 0, nullptr);
+		(void) kevent (g.watch_fd, &ev, 1, nullptr, 0, nullptr);
 	}
+#endif
+}
+
+fun listing_drop (list<listing>::iterator i) {
+#ifdef __linux__
+	if (i->wd != -1)
+		inotify_rm_watch (g.watch_fd, i->wd);
+#endif
+	g.listings_size -= i->size ();
+	g.listings.erase (i);
+}
+
+/// Forget a listing that has been invalidated by file watch events
+fun listing_invalidate (int wd) {
+	for (auto i = g.listings.begin (); i != g.listings.end (); i++)
+		if (i->wd == wd)
+			return listing_drop (i);
+}
+
+/// Keep a listing, making room for it
+fun listing_keep (listing &&l) {
+	g.listings_size += l.size ();
+	g.listings.push_front (move (l));
+	while (g.listings_size > g.listings_limit)
+		listing_drop (prev (g.listings.end ()));
+}
+
+/// Check whether a listing for the given directory is available
+fun listing_cached (const string &path) -> bool {
+	return any_of (begin (g.listings), end (g.listings),
+		[&](const listing &l) {
+			return l.id.path == path && l.id.show_hidden == g.show_hidden;
+		});
+}
+
+/// Keep the current directory's entries for when it is returned to
+fun listing_stash () {
+	if (g.listed.path.empty () || g.listed.path == g.cwd
+	 || g.loading || g.out_of_date || g.partial_info || g.truncated
+	 || !g.listings_limit)
+		return;
+
+	listing l;
+	l.id = move (g.listed);
+	l.entries = move (g.entries);
+	l.entries.shrink_to_fit ();
+	l.names = move (g.names);
+	l.names.shrink_to_fit ();
+	copy (begin (g.max_widths), end (g.max_widths), l.max_widths);
+	l.partial_info = g.partial_info;
+	l.sort_mode = g.sort_mode;
+#ifdef __linux__
+	// inotify keeps telling us about changes, so there's no need to guess
+	swap (l.wd, g.watch_wd);
+#endif
+	listing_keep (move (l));
+}
+
+/// Bring back entries of the current directory if they're still valid
+fun listing_restore () -> bool {
+	auto i = g.listings.begin ();
+	while (i != g.listings.end () && (i->id.path != g.cwd
+		|| i->id.show_hidden != g.show_hidden))
+		i++;
+	if (i == g.listings.end ())
+		return false;
+
+	// Directory modification times have a resolution of one second
+	// on some systems, so changes from within that second are suspect
+	struct stat info = {};
+	const auto &id = i->id;
+	if (stat (".", &info)
+	 || info.st_dev != id.info.st_dev || info.st_ino != id.info.st_ino
+	 || info.st_mtime != id.info.st_mtime || info.st_ctime != id.info.st_ctime
+	 || (i->wd == -1 && max (info.st_mtime, info.st_ctime) >= id.read_at)) {
+		listing_drop (i);
+		return false;
+	}
+
+	g.listed = move (i->id);
+	g.entries = move (i->entries);
+	g.names = move (i->names);
+	copy (begin (i->max_widths), end (i->max_widths), g.max_widths);
+	g.partial_info = i->partial_info;
+	bool have_widths = i->have_widths;
+	bool collated = i->sort_mode == g.sort_mode;
+	g.listings_size -= i->size ();
+	g.listings.erase (i);
+
+	// Prefetching can't format entries, and the sort mode may have changed
+	if (!have_widths)
+		for (const auto &e : g.entries)
+			widen_columns (e);
+	if (!collated)
+		recollate ();
+	return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/// Read a directory into a listing on a worker thread
+fun prefetch_run (prefetch &job) {
+	auto &l = job.result;
+	l.id = {job.path, {}, time (NULL), job.show_hidden};
+	l.names.assign (1, 0);
+	for (auto &width : l.max_widths)
+		width = 0;
+	l.have_widths = l.partial_info = false;
+	l.sort_mode = job.options.sort_mode;
+
+	DIR *dir = nullptr;
+	int fd = open (job.path.c_str (), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || fstat (fd, &l.id.info) || !(dir = fdopendir (fd))) {
+		if (fd >= 0)
+			close (fd);
+		job.failed = true;
+		return;
+	}
+
 	while (auto f = readdir (dir)) {
+		if (job.cancelled || (job.limit && l.entries.size () >= job.limit)) {
+			job.failed = true;
+			break;
+		}
+
 		string name = f->d_name;
-		// Two dots are for navigation but this ain't as useful
 		if (name == ".")
 			continue;
-		if (name == ".." ? g.cwd != "/" : (name[0] != '.' || g.show_hidden))
-			g.entries.push_back (make_entry (f));
+		if (name == ".."
+			? job.path != "/" : (name[0] != '.' || job.show_hidden)) {
+			entry e;
+			e.name = intern (l.names, name.c_str ());
+			e.mode = DTTOIF (f->d_type);
+			l.entries.push_back (move (e));
+		}
+	}
+
+	// The names mustn't move while make_entry() looks at them
+	for (size_t i = 0; i < l.entries.size () && !job.failed; i++) {
+		auto &e = l.entries[i];
+		metadata m;
+		string name = l.names.c_str () + e.name;
+		make_entry (dirfd (dir), name.c_str (), e, m, job.options);
+		store_metadata (e, m, l.names);
+		job.failed = job.cancelled;
 	}
 	closedir (dir);
+}
+
+/// Stop caring about the directory being prefetched
+fun prefetch_cancel () {
+	auto job = move (g.prefetching);
+	job->cancelled = true;
+#ifdef __linux__
+	if (job->wd != -1 && !watch_in_use (job->wd))
+		inotify_rm_watch (g.watch_fd, job->wd);
+#endif
+}
 
-	g.selection = filter_selection (g.selection);
+/// Take in the results of a finished prefetch
+fun prefetch_finish () {
+	auto job = g.prefetching;
+	if (job->failed || job->dirty)
+		g.prefetch_tried.insert (job->path);
+#ifdef __linux__
+	// The directory may have been entered in the meantime
+	if (job->wd != -1 && watch_in_use (job->wd))
+		job->wd = -1, job->failed = true;
+#endif
+	if (job->failed || job->dirty)
+		return prefetch_cancel ();
+
+	g.prefetching.reset ();
+	job->result.wd = job->wd;
+	listing_keep (move (job->result));
+}
+
+fun reload_finish () {
+	if (g.loading) {
+		closedir (g.loading);
+		g.loading = nullptr;
+	}
+	g.reselect.clear ();
+
+	auto anchor = g.load_anchor;
+	g.load_anchor.clear ();
+	resort (anchor);
+	if (!anchor.empty () && at_cursor ().filename () != anchor)
+		lookup (to_wide (anchor));
+	trace_reload_end ();
+	if (g.watch_refreshing) {
+		g.watch_cost = monotonic_ts_ms () - g.watch_last;
+		g.watch_refreshing = false;
+	}
+
+	g.cursor = max (0, min (g.cursor, int (g.entries.size ()) - 1));
+	g.offset = max (0, min (g.offset, int (g.entries.size ()) - 1));
+}
+
+/// Read up to `limit` more directory entries, and finish the reload
+/// once there are no more of them
+fun reload_step (size_t limit) {
+	auto start = g.entries.size ();
+	bool finished = false;
+	TRACE_BEGIN (READDIR);
+	while (g.entries.size () - start < limit) {
+		// Rather than run out of memory, show what fits, and say so
+		if (g.entry_limit && g.entries.size () >= g.entry_limit) {
+			g.truncated = finished = true;
+			break;
+		}
+
+		auto f = readdir (g.loading);
+		if ((finished = !f))
+			break;
+
+		string name = f->d_name;
+		// Two dots are for navigation but this ain't as useful
+		if (name == ".")
+			continue;
+		if (name == ".." ? g.cwd != "/" : (name[0] != '.' || g.show_hidden)) {
+			entry e;
+			e.name = intern (name.c_str ());
+			e.mode = DTTOIF (f->d_type);
+
+			// The selection is only counted once sizes are known
+			auto i = g.reselect.empty ()
+				? g.reselect.end () : g.reselect.find (name);
+			if (i != g.reselect.end ()) {
+				g.reselect.erase (i);
+				e.selected = true;
+			}
+			g.entries.push_back (move (e));
+		}
+	}
+	TRACE_END (READDIR);
+
+	auto added = g.entries.data () + start;
+	auto count = g.entries.size () - start;
+	auto fd = dirfd (g.loading);
+	vector<metadata> meta (count);
+#ifdef HAVE_LIBURING
+	TRACE_BEGIN (STAT);
+	(void) uring_stat (fd, added, meta.data (), count);
+	TRACE_END (STAT);
+#endif
+	auto options = scan_here ();
+	pool_for (count, [&](size_t i) {
+		make_entry (fd, added[i].filename (), added[i], meta[i], options);
+	});
+
+	for (size_t i = 0; i < count; i++) {
+		store_metadata (added[i], meta[i]);
+		widen_columns (added[i]);
+		if (added[i].selected) {
+			g.selected++;
+			g.selected_size += selection_weight (added[i]);
+		}
+	}
+	g.entries_version++;
+
+	if (finished)
+		reload_finish ();
+}
+
+/// Start reading the current directory, blocking only for a short while.
+/// The rest is left for the main loop to process.
+fun reload (bool keep_anchor) {
+	trace_reload_begin ();
+	if (g.listed.path != g.cwd)
+		g.watch_cost = 0;
+	id_names_validate (g.unames);
+	id_names_validate (g.gnames);
+
+	// The cursor may be sitting at a placeholder position
+	auto anchor = g.loading && !g.load_anchor.empty ()
+		? g.load_anchor : at_cursor ().filename ();
+	g.load_anchor = keep_anchor ? anchor : "";
+	if (g.loading) {
+		closedir (g.loading);
+		g.loading = nullptr;
+	} else {
+		listing_stash ();
+	}
+
+	// Entries are going to be created anew
+	g.reselect = selection_names ();
+	g.selected = g.selected_size = 0;
+
+	auto now = time (NULL); g.now = *localtime (&now);
+	g.entries.clear ();
+	g.entries_version++;
+	g.names.assign (1, 0);
+	g.names_garbage = 0;
+	g.rows.clear ();
+	for (auto &width : g.max_widths)
+		width = 0;
+	g.partial_info = false;
+	g.truncated = false;
+	g.listed = {};
+
+	// Start watching early, so that no change escapes our attention
+	g.out_of_date = g.out_of_sync = g.watch_pending = false;
+	g.changed.clear ();
+	bool restored = listing_restore ();
+	watch_directory ();
+	if (restored) {
+		selection_restore (move (g.reselect));
+		reload_finish ();
+		return;
+	}
+
+	g.listed = {g.cwd, {}, now, g.show_hidden};
+	if (!(g.loading = opendir ("."))) {
+		g.listed = {};
+		show_message (strerror (errno));
+		if (g.cwd != "/") {
+			entry e;
+			metadata m;
+			e.name = intern ("..");
+			e.mode = S_IFDIR;
+			make_entry (AT_FDCWD, e.filename (), e, m, scan_here ());
+			widen_columns (e);
+			g.entries.push_back (move (e));
+		}
+		reload_finish ();
+		return;
+	}
+
+	(void) fstat (dirfd (g.loading), &g.listed.info);
+
+	// Small or fast directories shouldn't flicker as they're being sorted
+	auto deadline = monotonic_ts_ms () + 100;
+	reload_step (max (1, visible_lines ()));
+	while (g.loading && monotonic_ts_ms () < deadline)
+		reload_step (256);
+	if (g.loading)
+		resort ();
+}
+
+/// Bring entries up to date with changes reported by the file watch,
+/// only re-reading those entries that have been named in the events
+fun reload_changes () {
+	if (g.loading || g.out_of_sync || g.truncated || g.changed.empty ()) {
+		reload (true);
+		return;
+	}
+
+	string anchor = at_cursor ().filename ();
+	auto now = time (NULL); g.now = *localtime (&now);
+
+	set<string> reselect;
+	for (auto &e : g.entries)
+		if (e.selected && g.changed.count (e.filename ())) {
+			reselect.insert (e.filename ());
+			set_selected (e, false);
+		}
+
+	// Take out all affected entries, and put back those that still exist
+	bool stale[entry::COLUMNS] = {};
+	auto removed = remove_if (begin (g.entries), end (g.entries),
+		[&](const entry &e) {
+			if (!g.changed.count (e.filename ()))
+				return false;
+			if (S_ISDIR (e.mode))
+				g.usage.erase ({e.dev, e.ino});
+			for (int col = 0; col < entry::FILENAME; col++)
+				if (column_width (e, col) >= g.max_widths[col])
+					stale[col] = true;
+
+			g.rows.erase (e.name);
+			release (e.name);
+			release (e.target);
+			release (e.collated);
+			return true;
+		});
+	g.entries.erase (removed, end (g.entries));
+	if (g.names_garbage > g.names.size () / 2)
+		compact_names ();
+
+	for (const auto &name : g.changed) {
+		struct stat info = {};
+		if (name[0] == '.' && !g.show_hidden)
+			continue;
+		if (lstat (name.c_str (), &info) && errno == ENOENT)
+			continue;
+
+		entry e;
+		metadata m;
+		e.name = intern (name.c_str ());
+		make_entry (AT_FDCWD, e.filename (), e, m, scan_here ());
+		store_metadata (e, m);
+		widen_columns (e);
+		if (reselect.count (name))
+			set_selected (e, true);
+		g.entries.insert (upper_bound (begin (g.entries), end (g.entries), e),
+			move (e));
+	}
 
-readfail:
-	g.out_of_date = false;
 	for (int col = 0; col < entry::COLUMNS; col++) {
+		if (!stale[col])
+			continue;
 		auto &longest = g.max_widths[col] = 0;
 		for (const auto &entry : g.entries)
-			longest = max (longest, compute_width (entry.cols[col]));
+			longest = max (longest, column_width (entry, col));
 	}
 
-	resort (anchor);
+	g.out_of_date = false;
+	g.changed.clear ();
+	g.entries_version++;
+
+	focus (anchor);
+	g.cursor = max (0, min (g.cursor, int (g.entries.size ()) - 1));
+	g.offset = max (0, min (g.offset, int (g.entries.size ()) - 1));
+}
+
+extern char **environ;
+
+/// Create a pipe that won't leak into programs that other threads spawn
+fun pipe_cloexec (int fds[2]) -> int {
+#ifdef __APPLE__
+	// There's no pipe2(), so a concurrent spawn() may catch the pipe open
+	if (pipe (fds))
+		return -1;
+	fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl (fds[1], F_SETFD, FD_CLOEXEC);
+	return 0;
+#else
+	return pipe2 (fds, O_CLOEXEC);
+#endif
+}
+
+/// Start a program with some extra environment variables, and possibly
+/// different standard streams.  The program is put in a new process group,
+/// which is given the terminal if it is to run in the foreground.
+fun spawn (const vector<const char *> &argv, const vector<string> &env,
+	int input, int output, int error, bool foreground) -> pid_t {
+	vector<string> strings (env);
+	for (auto e = environ; *e; e++) {
+		auto name = string (*e, strcspn (*e, "=") + 1);
+		if (none_of (env.begin (), env.end (), [&](const string &s) {
+			return !s.compare (0, name.length (), name); }))
+			strings.push_back (*e);
+	}
+	vector<char *> envp;
+	for (auto &s : strings)
+		envp.push_back (&s[0]);
+	envp.push_back (nullptr);
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init (&actions);
+	if (input >= 0)
+		posix_spawn_file_actions_adddup2 (&actions, input, STDIN_FILENO);
+	if (output >= 0)
+		posix_spawn_file_actions_adddup2 (&actions, output, STDOUT_FILENO);
+	if (error >= 0)
+		posix_spawn_file_actions_adddup2 (&actions, error, STDERR_FILENO);
+
+	// Children would otherwise inherit our ignoring of SIGPIPE
+	posix_spawnattr_t attr;
+	posix_spawnattr_init (&attr);
+	sigset_t defaults;
+	sigemptyset (&defaults);
+	sigaddset (&defaults, SIGPIPE);
+	posix_spawnattr_setsigdefault (&attr, &defaults);
+	posix_spawnattr_setpgroup (&attr, 0);
+	posix_spawnattr_setflags (&attr,
+		POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ (2, 35)
+	if (foreground)
+		posix_spawn_file_actions_addtcsetpgrp_np (&actions, STDOUT_FILENO);
+#endif
+#endif
+
+	pid_t child = -1;
+	if (posix_spawnp (&child, argv.at (0), &actions, &attr,
+		const_cast<char **> (argv.data ()), envp.data ()))
+		child = -1;
+	posix_spawnattr_destroy (&attr);
+	posix_spawn_file_actions_destroy (&actions);
+
+	// Elsewhere, the child may briefly run in the background
+	if (child > 0 && foreground)
+		tcsetpgrp (STDOUT_FILENO, child);
+	return child;
+}
+
+/// Find mc.ext.ini the same way our helper scripts do, but only once
+fun mc_ext_config () -> const string & {
+	if (g.mc_ext_ini_known)
+		return g.mc_ext_ini;
+
+	g.mc_ext_ini_known = true;
+	auto exists = [](const string &path) {
+		struct stat info = {};
+		return !stat (path.c_str (), &info) && S_ISREG (info.st_mode);
+	};
+	const char *home = getenv ("HOME");
+	if (home && exists (string (home) + "/.config/mc/mc.ext.ini"))
+		return g.mc_ext_ini = string (home) + "/.config/mc/mc.ext.ini";
+
+	// This handles both MC_DATADIR and odd installation locations
+	string datadir;
+	auto command = "command -v mc >/dev/null && mc --datadir 2>/dev/null";
+	if (auto fp = popen (command, "r")) {
+		char buf[BUFSIZ];
+		while (fgets (buf, sizeof buf, fp))
+			datadir += buf;
+		pclose (fp);
+	}
+	datadir = datadir.substr (0, datadir.find ('\n'));
+	datadir = datadir.substr (0, datadir.find (" ("));
+	for (const auto &dir : {datadir, string ("/etc/mc")})
+		if (!dir.empty () && exists (dir + "/mc.ext.ini"))
+			return g.mc_ext_ini = dir + "/mc.ext.ini";
+	return g.mc_ext_ini;
+}
+
+fun mc_ext_stop () {
+	for (auto &fd : g.mc_ext_fds)
+		close (fd), fd = -1;
+	kill (g.mc_ext_pid, SIGTERM);
+	waitpid (g.mc_ext_pid, nullptr, 0);
+	g.mc_ext_pid = 0;
+}
+
+/// Launch an sdn-mc-ext process that processes requests from a pipe,
+/// so that it need not be started for each file, nor reload anything
+fun mc_ext_start () {
+	int in[2] = {-1, -1}, out[2] = {-1, -1};
+	if (pipe_cloexec (in) || pipe_cloexec (out)) {
+		for (auto fd : {in[0], in[1], out[0], out[1]})
+			if (fd >= 0)
+				close (fd);
+		g.mc_ext_pid = -1;
+		return;
+	}
 
-	g.cursor = max (0, min (g.cursor, int (g.entries.size ()) - 1));
-	g.offset = max (0, min (g.offset, int (g.entries.size ()) - 1));
+	// This is often used in %env{} expansion, just like in our helpers
+	const char *pager = getenv ("PAGER");
+	g.mc_ext_pid = spawn ({"sdn-mc-ext", "--server", mc_ext_config ().c_str (),
+		nullptr}, {"PAGER=" + string (pager ? pager : "less")},
+		in[0], out[1], -1, false);
+	close (in[0]);
+	close (out[1]);
+	g.mc_ext_fds[0] = in[1];
+	g.mc_ext_fds[1] = out[0];
+	if (g.mc_ext_pid < 0) {
+		for (auto &fd : g.mc_ext_fds)
+			close (fd), fd = -1;
+	}
+}
 
-#ifdef __linux__
-	if (g.watch_wd != -1)
-		inotify_rm_watch (g.watch_fd, g.watch_wd);
+/// Have the sdn-mc-ext process look up a command for one of our helpers,
+/// and return environment variables that will let it skip doing so
+fun mc_ext_query (const char *verb, const string &filename) -> vector<string> {
+	if (!g.mc_ext_pid)
+		mc_ext_start ();
+	if (g.mc_ext_pid < 0)
+		return {};
+
+	auto request = string (verb) + '\0' + (!filename.empty ()
+		&& filename.front () == '/' ? filename : g.cwd + "/" + filename) + '\0';
+	for (size_t written = 0; written < request.length (); ) {
+		auto n = write (g.mc_ext_fds[0],
+			request.data () + written, request.length () - written);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			mc_ext_stop ();
+			return {};
+		}
+		written += n;
+	}
 
-	// We don't show atime, so access and open are merely spam
-	g.watch_wd = inotify_add_watch (g.watch_fd, ".",
-		(IN_ALL_EVENTS | IN_ONLYDIR | IN_EXCL_UNLINK) & ~(IN_ACCESS | IN_OPEN));
-#elif !defined __CYGWIN__
-	if (g.watch_wd != -1)
-		close (g.watch_wd);
+	// The reply consists of five NUL-terminated fields.  The terminal is
+	// no longer ours to redraw, nor is ^C going to reach anyone but us,
+	// so a stalling server is best left for the helper to do without.
+	auto deadline = monotonic_ts_ms () + 500;
+	vector<string> fields (1);
+	char buf[BUFSIZ];
+	while (fields.size () <= 5) {
+		auto now = monotonic_ts_ms ();
+		pollfd pfd = {g.mc_ext_fds[1], POLLIN, 0};
+		auto ready = now < deadline
+			? poll (&pfd, 1, deadline - now) : 0;
+		if (ready < 0 && errno == EINTR)
+			continue;
+		if (ready <= 0) {
+			mc_ext_stop ();
+			return {};
+		}
 
-	if ((g.watch_wd = open (".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
-		// At least the macOS kqueue doesn't report anything too specific
-		struct kevent ev {};
-		EV_SET (&ev, g.watch_wd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
-			NOTE_WRITE | NOTE_LINK, 0, nullptr);
-		(void) kevent (g.watch_fd, &ev, 1, nullptr, 0, nullptr);
+		auto n = read (g.mc_ext_fds[1], buf, sizeof buf);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			mc_ext_stop ();
+			return {};
+		}
+		for (ssize_t i = 0; i < n; i++)
+			if (buf[i])
+				fields.back () += buf[i];
+			else
+				fields.emplace_back ();
 	}
-#endif
+	return {"SDN_MC_EXT_KIND=" + fields[0], "SDN_MC_EXT_COMMAND=" + fields[1],
+		"MC_EXT_FILENAME=" + fields[2], "MC_EXT_BASENAME=" + fields[3],
+		"MC_EXT_CURRENTDIR=" + fields[4]};
 }
 
-fun run_program (initializer_list<const char *> list, const string &filename) {
+fun run_program (initializer_list<const char *> list, const string &filename,
+	const char *verb = nullptr) {
 	auto args = (!filename.empty () && filename.front () == '-' ? " -- " : " ")
 		+ shell_escape (filename);
+
+	// XXX: this doesn't try them all out,
+	// though it shouldn't make any noticeable difference
+	const char *found = nullptr;
+	for (auto program : list)
+		if ((found = program))
+			break;
 	if (g.ext_helpers) {
-		// XXX: this doesn't try them all out,
-		// though it shouldn't make any noticeable difference
-		const char *found = nullptr;
-		for (auto program : list)
-			if ((found = program))
-				break;
 		g.ext_helper.assign (found).append (args);
 		g.quitting = true;
 		return;
 	}
 
 	endwin ();
-	switch (pid_t child = fork ()) {
-		int status;
-	case -1:
-		break;
-	case 0:
-		// Put the child in a new foreground process group...
-		setpgid (0, 0);
-		tcsetpgrp (STDOUT_FILENO, getpgid (0));
 
-		for (auto program : list)
-			if (program) execl ("/bin/sh", "/bin/sh", "-c",
-				(program + args).c_str (), NULL);
-		_exit (EXIT_FAILURE);
-	default:
-		// ...and make sure of it in the parent as well
-		(void) setpgid (child, child);
+	// Our own helper scripts may save themselves some work
+	vector<string> env;
+	if (verb && found == string ("sdn-") + verb) {
+		env = mc_ext_query (capitalize (verb).c_str (), filename);
+		env.push_back ("SDN_MC_EXT_INI=" + mc_ext_config ());
+	}
 
-		// We don't provide job control--don't let us hang after ^Z
+	auto command = found + args;
+	auto child = spawn ({"/bin/sh", "-c", command.c_str (), nullptr},
+		env, -1, -1, -1, true);
+	if (child > 0) {
+		// We don't provide job control--don't let us hang after ^Z,
+		// or if the child tries to read before it gets the terminal
+		int status = 0;
 		while (waitpid (child, &status, WUNTRACED) > -1 && WIFSTOPPED (status))
-			if (WSTOPSIG (status) == SIGTSTP)
+			if (WSTOPSIG (status) == SIGTSTP || WSTOPSIG (status) == SIGTTIN)
 				kill (-child, SIGCONT);
 		tcsetpgrp (STDOUT_FILENO, getpgid (0));
 
@@ -1068,7 +3248,7 @@ fun run_program (initializer_list<const char *> list, const string &filename) {
 
 fun sdn_open (const string &filename) {
 	run_program ({(const char *) getenv ("SDN_OPENER"), "sdn-open", "xdg-open"},
-		filename);
+		filename, "open");
 }
 
 fun view_raw (const string &filename) {
@@ -1079,7 +3259,7 @@ fun view_raw (const string &filename) {
 
 fun sdn_view (const string &filename) {
 	run_program ({(const char *) getenv ("SDN_VIEWER"), "sdn-view",
-		(const char *) getenv ("PAGER"), "less", "cat"}, filename);
+		(const char *) getenv ("PAGER"), "less", "cat"}, filename, "view");
 }
 
 fun edit_raw (const string &filename) {
@@ -1091,37 +3271,7 @@ fun edit_raw (const string &filename) {
 fun sdn_edit (const string &filename) {
 	run_program ({(const char *) getenv ("SDN_EDITOR"), "sdn-edit",
 		(const char *) getenv ("VISUAL"), (const char *) getenv ("EDITOR"),
-		"vi"}, filename);
-}
-
-fun run_pager (FILE *contents) {
-	// We don't really need to set O_CLOEXEC, so we're not going to
-	rewind (contents);
-	endwin ();
-
-	switch (pid_t child = fork ()) {
-		int status;
-	case -1:
-		break;
-	case 0:
-		// Put the child in a new foreground process group...
-		setpgid (0, 0);
-		tcsetpgrp (STDOUT_FILENO, getpgid (0));
-		dup2 (fileno (contents), STDIN_FILENO);
-
-		// Behaviour copies man-db's man(1), similar to POSIX man(1)
-		for (auto pager : {(const char *) getenv ("PAGER"), "less", "cat"})
-			if (pager) execl ("/bin/sh", "/bin/sh", "-c", pager, NULL);
-		_exit (EXIT_FAILURE);
-	default:
-		// ...and make sure of it in the parent as well
-		(void) setpgid (child, child);
-		waitpid (child, &status, 0);
-		tcsetpgrp (STDOUT_FILENO, getpgid (0));
-	}
-
-	refresh ();
-	update ();
+		"vi"}, filename, "edit");
 }
 
 fun encode_key (Key k) -> string {
@@ -1138,26 +3288,151 @@ fun encode_key (Key k) -> string {
 	return encoded;
 }
 
-fun show_help () {
-	FILE *contents = tmpfile ();
-	if (!contents)
-		return;
+/// Show some text within the built-in viewer
+fun viewer_open (const string &title, string &&text) {
+	auto &v = g.view;
+	v.title = title;
+	v.text = move (text);
+	v.data = v.text.data ();
+	v.size = v.text.size ();
+	v.mapped = false;
+	v.truncated = false;
+	v.top = v.column = 0;
+	v.bottom_rows = -1;
+}
+
+/// Show a file within the built-in viewer, mapping it into memory
+fun view_builtin (const string &filename) {
+	int fd = open (filename.c_str (), O_RDONLY | O_CLOEXEC);
+	struct stat info = {};
+	if (fd < 0 || fstat (fd, &info)) {
+		show_message (strerror (errno));
+	} else if (!S_ISREG (info.st_mode)) {
+		show_message ("not a regular file");
+	} else if (!info.st_size) {
+		viewer_open (filename, {});
+	} else {
+		// The file getting truncated meanwhile is handled by viewer_sigbus()
+		auto data = mmap (nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			show_message (strerror (errno));
+		} else {
+			viewer_open (filename, {});
+			g.view.data = (const char *) data;
+			g.view.size = info.st_size;
+			g.view.mapped = true;
+		}
+	}
+	if (fd >= 0)
+		close (fd);
+}
+
+fun viewer_search (bool backwards) {
+	auto &v = g.view;
+	const auto &needle = v.needle;
+	if (needle.empty ())
+		return show_message ("no previous search");
+
+	const char *found = nullptr;
+	if (!backwards) {
+		auto from = viewer_next (v.top);
+		found = (const char *) memmem (v.data + from, v.size - from,
+			needle.data (), needle.size ());
+	} else {
+		// There is no memrmem(), so look for the first byte, then compare
+		for (auto end = v.top; !found && end; ) {
+			auto p = (const char *) memrchr (v.data, needle[0], end);
+			if (!p)
+				break;
+			if (size_t (v.data + v.size - p) >= needle.size ()
+			 && !memcmp (p, needle.data (), needle.size ()))
+				found = p;
+			end = p - v.data;
+		}
+	}
+	if (!found)
+		return show_message ("pattern not found");
+	v.top = min (viewer_start (found - v.data), viewer_bottom ());
+}
 
+fun viewer_prompt (bool backwards) {
+	g.view.backwards = backwards;
+	g.editor = backwards ? L"search backward" : L"search forward";
+	g.editor_on[ACTION_INPUT_CONFIRM] = [] {
+		// Like in less(1), an empty pattern repeats the last search
+		if (!g.editor_line.empty ())
+			g.view.needle = to_mb (g.editor_line);
+		viewer_search (g.view.backwards);
+	};
+}
+
+fun handle_viewer (Key k) {
+	auto i = g_viewer_actions.find (k);
+	switch (i == g_viewer_actions.end () ? ACTION_NONE : i->second) {
+	case ACTION_QUIT:
+		viewer_close ();
+		break;
+	case ACTION_UP:
+		viewer_scroll (-1);
+		break;
+	case ACTION_DOWN:
+		viewer_scroll (+1);
+		break;
+	case ACTION_PAGE_PREVIOUS:
+		viewer_scroll (-visible_lines ());
+		break;
+	case ACTION_PAGE_NEXT:
+		viewer_scroll (+visible_lines ());
+		break;
+	case ACTION_TOP:
+		g.view.top = 0;
+		break;
+	case ACTION_BOTTOM:
+		g.view.top = viewer_bottom ();
+		break;
+	case ACTION_SCROLL_LEFT:
+		g.view.column = max (0, g.view.column - COLS / 2);
+		break;
+	case ACTION_SCROLL_RIGHT:
+		g.view.column += COLS / 2;
+		break;
+
+	case ACTION_SEARCH:
+		viewer_prompt (false);
+		break;
+	case ACTION_SEARCH_BACKWARD:
+		viewer_prompt (true);
+		break;
+	case ACTION_SEARCH_NEXT:
+		viewer_search (g.view.backwards);
+		break;
+	case ACTION_SEARCH_PREVIOUS:
+		viewer_search (!g.view.backwards);
+		break;
+	case ACTION_REDRAW:
+		clear ();
+		break;
+	default:
+		if (k != KEY (RESIZE))
+			beep ();
+	}
+}
+
+fun show_help () {
+	string contents;
 	for (const auto &kv : g_binding_contexts) {
-		fprintf (contents, "%s\n",
-			underline (capitalize (kv.first + " key bindings")).c_str ());
+		contents += underline (capitalize (kv.first + " key bindings")) + "\n";
 		map<action, string> agg;
 		for (const auto &kv : *kv.second)
 			agg[kv.second] += encode_key (kv.first) + " ";
 		for (const auto &kv : agg) {
 			auto action = g.action_names[kv.first];
 			action.append (max (0, 20 - int (action.length ())), ' ');
-			fprintf (contents, "%s %s\n", action.c_str (), kv.second.c_str ());
+			contents += action + " " + kv.second + "\n";
 		}
-		fprintf (contents, "\n");
+		contents += "\n";
 	}
-	run_pager (contents);
-	fclose (contents);
+	viewer_open ("Help", move (contents));
 }
 
 fun matches_to_editor_info (int matches) {
@@ -1171,33 +3446,88 @@ fun matches_to_editor_info (int matches) {
 		g.editor_info = L"(" + to_wstring (matches) + L" matches)";
 }
 
+/// The part of a shell glob that any match must literally begin with
+fun glob_prefix (const string &pattern) -> string {
+	return pattern.substr (0, pattern.find_first_of ("*?[\\"));
+}
+
+fun compile_pattern (const string &needle) -> name_pattern {
+	return {needle, needle + "*", glob_prefix (needle) == needle};
+}
+
+fun pattern_matches (const name_pattern &pattern, const char *name) -> bool {
+	// Literal needles may skip the costlier fnmatch()
+	if (pattern.literal)
+		return !strncmp (name, pattern.needle.c_str (), pattern.needle.size ());
+	return !fnmatch (pattern.glob.c_str (), name, 0);
+}
+
+/// Find entries beginning with the glob `needle`, in ascending order
+fun match_entries (const string &needle) -> const vector<uint32_t> & {
+	// Extending a pattern can only narrow results down, unless it changes
+	// the meaning of what is already there
+	auto &last = g.last_match;
+	bool narrow = last.version == g.entries_version
+		&& !needle.compare (0, last.needle.size (), last.needle)
+		&& last.needle.find_first_of ("[\\") == string::npos;
+
+	vector<uint32_t> candidates;
+	if (narrow) {
+		candidates = move (last.matches);
+	} else {
+		auto range = search_range (glob_prefix (needle));
+		candidates.assign (range.first, range.second);
+		sort (begin (candidates), end (candidates));
+	}
+
+	auto pattern = compile_pattern (needle);
+	candidates.erase (remove_if (begin (candidates), end (candidates),
+		[&](uint32_t i) {
+			return !pattern_matches (pattern, g.entries[i].filename ());
+		}), end (candidates));
+
+	last.needle = needle;
+	last.matches = move (candidates);
+	last.version = g.entries_version;
+	return last.matches;
+}
+
 fun match (const wstring &needle, int push) -> int {
-	string pattern = to_mb (needle) + "*";
-	bool jump_to_first = push || fnmatch (pattern.c_str (),
-		g.entries[g.cursor].filename.c_str (), 0) == FNM_NOMATCH;
-	int best = g.cursor, matches = 0, step = push + !push;
-	for (int i = 0, count = g.entries.size (); i < count; i++) {
-		int o = (g.cursor + (count + i * step) + (count + push)) % count;
-		if (!fnmatch (pattern.c_str (), g.entries[o].filename.c_str (), 0)
-		 && !matches++ && jump_to_first)
-			best = o;
+	const auto &matches = match_entries (to_mb (needle));
+	if (matches.empty ())
+		return 0;
+
+	bool jump_to_first = push
+		|| !binary_search (begin (matches), end (matches), g.cursor);
+	if (jump_to_first) {
+		int count = g.entries.size (),
+			start = (g.cursor + count + push) % count;
+		if (push >= 0) {
+			auto i = lower_bound (begin (matches), end (matches), start);
+			g.cursor = i != end (matches) ? *i : matches.front ();
+		} else {
+			auto i = upper_bound (begin (matches), end (matches), start);
+			g.cursor = i != begin (matches) ? *--i : matches.back ();
+		}
 	}
-	g.cursor = best;
-	return matches;
+	return matches.size ();
 }
 
 fun match_interactive (int push) {
 	matches_to_editor_info (match (g.editor_line, push));
 }
 
-fun select_matches (bool dotdot) -> set<string> {
-	set<string> matches;
-	for (const auto &e : g.entries) {
-		if (!dotdot && e.filename == "..")
+/// Return indexes of entries that match the editor line as a glob
+fun select_matches (bool dotdot) -> vector<uint32_t> {
+	vector<uint32_t> matches;
+	auto pattern = to_mb (g.editor_line);
+	auto range = search_range (glob_prefix (pattern));
+	for (auto i = range.first; i != range.second; i++) {
+		const auto &e = g.entries[*i];
+		if (!dotdot && !strcmp (e.filename (), ".."))
 			continue;
-		if (!fnmatch (to_mb (g.editor_line).c_str (),
-			e.filename.c_str (), FNM_PATHNAME))
-			matches.insert (e.filename);
+		if (!fnmatch (pattern.c_str (), e.filename (), FNM_PATHNAME))
+			matches.push_back (*i);
 	}
 	return matches;
 }
@@ -1206,21 +3536,6 @@ fun select_interactive (bool dotdot) {
 	matches_to_editor_info (select_matches (dotdot).size ());
 }
 
-/// Stays on the current item unless there are better matches
-fun lookup (const wstring &needle) {
-	int best = g.cursor;
-	size_t best_n = 0;
-	for (int i = 0, count = g.entries.size (); i < count; i++) {
-		int o = (g.cursor + i) % count;
-		size_t n = prefix_length (to_wide (g.entries[o].filename), needle);
-		if (n > best_n) {
-			best = o;
-			best_n = n;
-		}
-	}
-	g.cursor = best;
-}
-
 fun fix_cursor_and_offset () {
 	g.cursor = min (g.cursor, int (g.entries.size ()) - 1);
 	g.cursor = max (g.cursor, 0);
@@ -1264,7 +3579,7 @@ fun pop_levels (const string &old_cwd) {
 			g.offset = i->offset;
 			g.cursor = i->cursor;
 			anchor = i->filename;
-			g.selection = filter_selection (i->selection);
+			selection_restore (i->selection);
 		}
 		i++;
 		g.levels.pop_back ();
@@ -1277,7 +3592,9 @@ fun pop_levels (const string &old_cwd) {
 	}
 
 	fix_cursor_and_offset ();
-	if (!anchor.empty () && at_cursor ().filename != anchor)
+	if (g.loading && !anchor.empty ())
+		g.load_anchor = anchor;
+	else if (!anchor.empty () && at_cursor ().filename () != anchor)
 		lookup (to_wide (anchor));
 }
 
@@ -1349,11 +3666,14 @@ fun change_dir (const string &path) {
 		return;
 	}
 
-	level last {g.offset, g.cursor, g.cwd, at_cursor ().filename, g.selection};
+	level last {g.offset, g.cursor, g.cwd, at_cursor ().filename (),
+		selection_names ()};
 	g.cwd = full_path;
 	bool same_path = last.path == g.cwd;
-	if (!same_path)
-		g.selection.clear ();
+	if (!same_path) {
+		selection_clear ();
+		g.prefetch_tried.clear ();
+	}
 
 	reload (same_path);
 
@@ -1393,24 +3713,25 @@ fun initial_cwd () -> string {
 }
 
 fun choose (const entry &entry, bool full) {
-	if (g.selection.empty ())
-		g.selection.insert (entry.filename);
-	for (const string &item : g.selection)
+	auto selection = selection_names ();
+	if (selection.empty ())
+		selection.insert (entry.filename ());
+	for (const string &item : selection)
 		g.chosen.push_back (full ? absolutize (g.cwd, item) : item);
 
-	g.selection.clear ();
+	selection_clear ();
 	g.no_chdir = full;
 	g.quitting = true;
 }
 
 fun enter (const entry &entry) {
 	// Dive into directories and accessible symlinks to them
-	if (!S_ISDIR (entry.info.st_mode)
-	 && !S_ISDIR (entry.target_info.st_mode)) {
+	if (!S_ISDIR (entry.mode)
+	 && !S_ISDIR (entry.target_mode)) {
 		// This could rather launch ${SDN_OPEN:-xdg-open} or something
 		choose (entry, false);
 	} else {
-		change_dir (entry.filename);
+		change_dir (entry.filename ());
 	}
 }
 
@@ -1425,7 +3746,7 @@ fun move_towards_spacing (int diff) -> bool {
 fun handle_editor (Key k) {
 	auto action = ACTION_NONE;
 	if (g.editor_inserting) {
-		(void) halfdelay (1);
+		(void) cbreak ();
 		g.editor_inserting = false;
 	} else {
 		auto i = g_input_actions.find (k);
@@ -1441,10 +3762,9 @@ fun handle_editor (Key k) {
 	auto original = g.editor_line;
 	switch (action) {
 	case ACTION_INPUT_CONFIRM:
+	case ACTION_INPUT_ABORT:
 		if (auto handler = g.editor_on[action])
 			handler ();
-		// Fall-through
-	case ACTION_INPUT_ABORT:
 		g.editor = 0;
 		g.editor_info.clear ();
 		g.editor_line.clear ();
@@ -1521,20 +3841,466 @@ fun handle_editor (Key k) {
 		g.editor_on_change ();
 }
 
+/// A file found by du_read(), with a path if it is a directory to descend into
+struct du_file {
+	dev_t dev; ino_t ino;               ///< Identity of the file
+	off_t size;                         ///< Apparent size
+	string path;                        ///< Absolute path to a directory
+};
+
+/// Stat everything within a directory, summing up sizes of files that
+/// can't have been counted elsewhere, and collecting all the others
+fun du_read (du_walk &walk, const string &path, vector<du_file> &found)
+	-> off_t {
+	int fd = open (path.c_str (),
+		O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	DIR *dir = fd < 0 ? nullptr : fdopendir (fd);
+	if (!dir) {
+		if (fd >= 0)
+			close (fd);
+		return 0;
+	}
+
+	off_t size = 0;
+	struct stat info = {};
+	while (auto f = readdir (dir)) {
+		if (walk.cancelled)
+			break;
+		if (!strcmp (f->d_name, ".") || !strcmp (f->d_name, "..")
+		 || fstatat (fd, f->d_name, &info, AT_SYMLINK_NOFOLLOW))
+			continue;
+
+		walk.items++;
+		if (S_ISDIR (info.st_mode))
+			found.push_back ({info.st_dev, info.st_ino, info.st_size,
+				path + (path == "/" ? "" : "/") + f->d_name});
+		else if (info.st_nlink > 1)
+			found.push_back ({info.st_dev, info.st_ino, info.st_size, ""});
+		else
+			size += info.st_size;
+	}
+	closedir (dir);
+	return size;
+}
+
+/// Take directories from the queue until it's empty and no one is busy.
+/// `visit` may queue more of them, while holding the lock.
+fun walk_worker (tree_walk &walk,
+	const function<void (const string &, size_t)> &visit) {
+	unique_lock<mutex> lock (walk.lock);
+	while (true) {
+		walk.wake.wait (lock, [&] {
+			return walk.cancelled || !walk.queue.empty () || !walk.busy;
+		});
+		if (walk.cancelled || walk.queue.empty ())
+			break;
+
+		auto item = move (walk.queue.front ());
+		walk.queue.pop_front ();
+		walk.busy++;
+		lock.unlock ();
+		visit (item.first, item.second);
+		lock.lock ();
+		walk.busy--;
+		walk.wake.notify_all ();
+	}
+	if (!--walk.workers) {
+		walk.finished = true;
+		(void) write (g.wake_fds[1], "", 1);
+	}
+}
+
+/// Run a walk on half of the worker pool, so that other jobs, such as
+/// prefetching, can still make progress while it's going on
+fun walk_start (const shared_ptr<tree_walk> &walk,
+	function<void (const string &, size_t)> visit) {
+	walk->workers = max<size_t> (1, pool_size () / 2);
+	for (size_t i = walk->workers; i--; )
+		pool_submit ([walk, visit] { walk_worker (*walk, visit); });
+}
+
+fun walk_cancel (tree_walk &walk) {
+	walk.cancelled = true;
+	{
+		// Waiting workers need to notice
+		lock_guard<mutex> guard (walk.lock);
+	}
+	walk.wake.notify_all ();
+}
+
+fun du_visit (du_walk &walk, const string &path, size_t root) {
+	vector<du_file> found;
+	auto size = du_read (walk, path, found);
+	lock_guard<mutex> guard (walk.lock);
+
+	// Hard links and bind mounts would otherwise be counted repeatedly
+	for (auto &file : found) {
+		if (!walk.seen.insert ({file.dev, file.ino}).second)
+			continue;
+		size += file.size;
+		if (!file.path.empty ())
+			walk.queue.emplace_back (move (file.path), root);
+	}
+	walk.sizes[root] += size;
+	walk.bytes += size;
+	walk.wake.notify_all ();
+}
+
+/// Changes deep within a directory don't affect its modification time,
+/// so its computed size is only trusted for a while
+static const int64_t g_du_ttl_ms = 60 * 1000;
+
+fun du_cancel () {
+	walk_cancel (*g.du);
+	g.du.reset ();
+	g.du_progress_at = 0;
+}
+
+fun du_status (const du_walk &walk) -> string {
+	return to_string (walk.bytes) + " bytes in "
+		+ to_string (walk.items) + " items";
+}
+
+/// Compute recursive sizes of the selected directories, or the one
+/// at the cursor, in the background
+fun du_start () {
+	auto walk = make_shared<du_walk> ();
+	for (const auto &e : g.entries) {
+		if (!S_ISDIR (e.mode)
+		 || (!g.selected ? &e != &at_cursor () : !e.selected))
+			continue;
+
+		auto index = walk->roots.size ();
+		walk->roots.push_back ({absolutize (g.cwd, e.filename ()),
+			e.dev, e.ino, e.mtime});
+		walk->queue.emplace_back (walk->roots.back ().path, index);
+		walk->seen.insert ({e.dev, e.ino});
+		walk->sizes.push_back (e.size);
+		walk->bytes += e.size;
+	}
+	if (walk->roots.empty () || g.cwd[0] != '/') {
+		beep ();
+		return;
+	}
+
+	g.du = walk;
+	g.du_progress_at = monotonic_ts_ms () + 100;
+	walk_start (walk, [walk](const string &path, size_t root) {
+		du_visit (*walk, path, root);
+	});
+}
+
+/// Bring everything that depends on directory sizes up to date
+fun du_refresh () {
+	selection_recount ();
+
+	auto &longest = g.max_widths[entry::SIZE] = 0;
+	for (const auto &e : g.entries)
+		longest = max (longest, column_width (e, entry::SIZE));
+	g.rows.clear ();
+	if (g.sort_column == entry::SIZE)
+		resort ();
+	else
+		g.entries_version++;
+}
+
+/// Indicate the progress of a disk usage walk, and collect its results
+fun du_check () {
+	if (!g.du->finished) {
+		if (monotonic_ts_ms () >= g.du_progress_at) {
+			show_message (du_status (*g.du) + "...");
+			g.du_progress_at = monotonic_ts_ms () + 100;
+			update ();
+		}
+		return;
+	}
+
+	auto walk = move (g.du);
+	g.du_progress_at = 0;
+	auto expires_at = monotonic_ts_ms () + g_du_ttl_ms;
+	for (size_t i = 0; i < walk->roots.size (); i++) {
+		const auto &root = walk->roots[i];
+		g.usage[{root.dev, root.ino}] =
+			{walk->sizes[i], root.mtime, expires_at};
+	}
+	if (!g.du_expire_at)
+		g.du_expire_at = expires_at;
+
+	du_refresh ();
+	show_message (du_status (*walk));
+	update ();
+}
+
+/// Forget directory sizes that may have changed since they were computed
+fun du_expire () {
+	auto now = monotonic_ts_ms ();
+	bool expired = false;
+	g.du_expire_at = 0;
+	for (auto i = g.usage.begin (); i != g.usage.end (); ) {
+		if (i->second.expires_at > now) {
+			if (!g.du_expire_at || i->second.expires_at < g.du_expire_at)
+				g.du_expire_at = i->second.expires_at;
+			i++;
+		} else {
+			i = g.usage.erase (i);
+			expired = true;
+		}
+	}
+	if (expired) {
+		du_refresh ();
+		update ();
+	}
+}
+
+/// Read a directory within the search root, and queue its subdirectories
+fun find_visit (find_walk &walk, const string &subpath, size_t depth) {
+	auto path = subpath.empty () ? walk.root : absolutize (walk.root, subpath);
+	int fd = open (path.c_str (),
+		O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	DIR *dir = fd < 0 ? nullptr : fdopendir (fd);
+	if (!dir) {
+		if (fd >= 0)
+			close (fd);
+		return;
+	}
+
+	scan_options options {path, true, walk.sort_mode};
+	bool descend = !walk.max_depth || depth + 1 < walk.max_depth;
+	vector<find_match> found;
+	vector<string> subdirs;
+	while (auto f = readdir (dir)) {
+		if (walk.cancelled)
+			break;
+
+		string name = f->d_name;
+		if (name == "." || name == ".."
+		 || (name[0] == '.' && !walk.show_hidden))
+			continue;
+
+		auto relative = subpath.empty () ? name : subpath + "/" + name;
+		mode_t mode = DTTOIF (f->d_type);
+		dev_t dev = 0;
+		bool examined = false;
+		if (pattern_matches (walk.pattern, name.c_str ())) {
+			find_match match {relative, {}, {}};
+			match.e.mode = mode;
+			make_entry (fd, name.c_str (), match.e, match.m, options);
+			// Entries will be named by their relative paths, not basenames
+			if (!subpath.empty ())
+				match.m.collated =
+					collation_key (relative.c_str (), walk.sort_mode);
+			mode = match.e.mode;
+			dev = match.e.dev;
+			examined = !match.e.failed;
+			found.push_back (move (match));
+		}
+		if (!descend)
+			continue;
+
+		// Directory entries need not have their type, nor the device
+		struct stat info = {};
+		if (!examined && (!mode || (S_ISDIR (mode) && walk.one_filesystem))) {
+			if (fstatat (fd, name.c_str (), &info, AT_SYMLINK_NOFOLLOW))
+				continue;
+			mode = info.st_mode;
+			dev = info.st_dev;
+		}
+		if (S_ISDIR (mode) && (!walk.one_filesystem || dev == walk.dev))
+			subdirs.push_back (move (relative));
+	}
+	closedir (dir);
+
+	lock_guard<mutex> guard (walk.lock);
+	for (auto &match : found)
+		walk.found.push_back (move (match));
+	for (auto &subdir : subdirs)
+		walk.queue.emplace_back (move (subdir), depth + 1);
+	walk.wake.notify_all ();
+}
+
+/// Exchange entries with those that have been set aside
+fun find_swap () {
+	auto &saved = g.find_saved;
+	auto &level = g.find_level;
+	swap (g.entries, saved.entries);
+	swap (g.names, saved.names);
+	swap_ranges (begin (g.max_widths), end (g.max_widths), saved.max_widths);
+	swap (g.partial_info, saved.partial_info);
+	swap (g.truncated, saved.truncated);
+	swap (g.offset, level.offset);
+	swap (g.cursor, level.cursor);
+	selection_recount ();
+
+	g.names_garbage = 0;
+	g.rows.clear ();
+	g.entries_version++;
+}
+
+fun find_info () {
+	matches_to_editor_info (g.entries.size ());
+	if (g.finding)
+		g.editor_info += L"...";
+}
+
+/// Search for the current editor line anew
+fun find_restart () {
+	if (g.finding) {
+		walk_cancel (*g.finding);
+		g.finding.reset ();
+	}
+
+	selection_clear ();
+	g.entries.clear ();
+	g.names.assign (1, 0);
+	g.names_garbage = 0;
+	g.rows.clear ();
+	for (auto &width : g.max_widths)
+		width = 0;
+	g.partial_info = false;
+	g.truncated = false;
+	g.offset = g.cursor = 0;
+	g.entries_version++;
+
+	g.find_check_at = 0;
+	auto needle = to_mb (g.editor_line);
+	if (!needle.empty ()) {
+		struct stat info = {};
+		auto walk = make_shared<find_walk> ();
+		walk->root = g.cwd;
+		walk->pattern = compile_pattern (needle);
+		walk->max_depth = g.find_depth;
+		walk->one_filesystem = g.find_xdev && !stat (".", &info);
+		walk->dev = info.st_dev;
+		walk->show_hidden = g.show_hidden;
+		walk->sort_mode = g.sort_mode;
+		walk->queue.emplace_back ("", 0);
+
+		g.finding = walk;
+		g.find_check_at = monotonic_ts_ms () + 100;
+		walk_start (walk, [walk](const string &path, size_t depth) {
+			find_visit (*walk, path, depth);
+		});
+	}
+	find_info ();
+}
+
+/// Replace the listing with results of a recursive search
+fun find_begin () {
+	if (g.loading || g.cwd[0] != '/') {
+		beep ();
+		return;
+	}
+
+	// Names are going to be moved around wholesale
+	compact_names ();
+	find_swap ();
+	g.find_mode = true;
+	find_restart ();
+}
+
+/// Bring back the directory listing
+fun find_end () {
+	if (!g.find_mode)
+		return;
+	if (g.finding) {
+		walk_cancel (*g.finding);
+		g.finding.reset ();
+	}
+
+	g.find_check_at = 0;
+	find_swap ();
+	g.find_saved = {};
+	g.find_mode = false;
+}
+
+/// Move matches over to the listing as they're coming in
+fun find_check () {
+	bool finished = g.finding->finished;
+	vector<find_match> found;
+	{
+		lock_guard<mutex> guard (g.finding->lock);
+		found.swap (g.finding->found);
+	}
+
+	auto start = monotonic_ts_ms ();
+	auto sorted = g.entries.size ();
+	for (auto &match : found) {
+		if (g.entry_limit && g.entries.size () >= g.entry_limit) {
+			walk_cancel (*g.finding);
+			g.truncated = finished = true;
+			break;
+		}
+		match.e.name = intern (match.path.c_str ());
+		store_metadata (match.e, match.m);
+		widen_columns (match.e);
+		g.entries.push_back (move (match.e));
+	}
+	if (!found.empty ())
+		resort_appended (sorted);
+
+	// Merging still takes time proportional to the number of results,
+	// so keep it from taking up more than about a quarter of the time
+	auto now = monotonic_ts_ms ();
+	if (finished)
+		g.finding.reset (), g.find_check_at = 0;
+	else
+		g.find_check_at = now + max<int64_t> (100, (now - start) * 4);
+	find_info ();
+	update ();
+}
+
+fun search_move (int push) {
+	if (g.find_mode)
+		g.cursor += push;
+	else
+		match_interactive (push);
+}
+
+fun search_enter () {
+	if (!g.find_mode)
+		return enter (at_cursor ());
+	if (g.entries.empty ())
+		return find_end ();
+
+	// Search results are named by their paths relative to the directory
+	const auto &e = at_cursor ();
+	string path = e.filename ();
+	bool directory = S_ISDIR (e.mode) || S_ISDIR (e.target_mode);
+	if (!directory)
+		choose (e, false);
+
+	find_end ();
+	if (directory)
+		change_dir (path);
+	else
+		selection_clear ();
+}
+
 fun handle (Key k) -> bool {
 	if (k == WEOF)
 		return false;
 
+	// Unsorted partial listings are only useful as far as the cursor goes
+	auto original_cursor = g.cursor;
+
 	// If an editor is active, let it handle the key instead and eat it
 	if (g.editor) {
 		handle_editor (k);
 		k = WEOF;
 	}
 
+	// The built-in viewer takes over the screen
+	if (g.view.data) {
+		if (k != WEOF)
+			handle_viewer (k);
+		update ();
+		return !g.quitting;
+	}
+
 	const auto &current = at_cursor ();
 	bool is_directory =
-		S_ISDIR (current.info.st_mode) ||
-		S_ISDIR (current.target_info.st_mode);
+		S_ISDIR (current.mode) ||
+		S_ISDIR (current.target_mode);
 
 	auto i = g_normal_actions.find (k);
 	switch (i == g_normal_actions.end () ? ACTION_NONE : i->second) {
@@ -1548,20 +4314,23 @@ fun handle (Key k) -> bool {
 		enter (current);
 		break;
 	case ACTION_OPEN:
-		sdn_open (current.filename);
+		sdn_open (current.filename ());
 		break;
 	case ACTION_VIEW_RAW:
 		// Mimic mc, it does not seem sensible to page directories
-		(is_directory ? change_dir : view_raw) (current.filename);
+		(is_directory ? change_dir : view_raw) (current.filename ());
 		break;
 	case ACTION_VIEW:
-		(is_directory ? change_dir : sdn_view) (current.filename);
+		(is_directory ? change_dir : sdn_view) (current.filename ());
+		break;
+	case ACTION_VIEW_BUILTIN:
+		(is_directory ? change_dir : view_builtin) (current.filename ());
 		break;
 	case ACTION_EDIT:
-		sdn_edit (current.filename);
+		sdn_edit (current.filename ());
 		break;
 	case ACTION_EDIT_RAW:
-		edit_raw (current.filename);
+		edit_raw (current.filename ());
 		break;
 	case ACTION_HELP:
 		show_help ();
@@ -1575,40 +4344,41 @@ fun handle (Key k) -> bool {
 
 	case ACTION_SORT_LEFT:
 		g.sort_column = (g.sort_column + entry::COLUMNS - 1) % entry::COLUMNS;
-		g.sort_flash_ttl = 2;
-		resort ();
+		g.sort_flash_until = monotonic_ts_ms () + 200;
+		g.partial_info ? reload (true) : resort ();
 		break;
 	case ACTION_SORT_RIGHT:
 		g.sort_column = (g.sort_column + entry::COLUMNS + 1) % entry::COLUMNS;
-		g.sort_flash_ttl = 2;
-		resort ();
+		g.sort_flash_until = monotonic_ts_ms () + 200;
+		g.partial_info ? reload (true) : resort ();
 		break;
 
 	case ACTION_SELECT:
 		g.editor = L"select";
 		g.editor_on_change                = [] { select_interactive (false); };
 		g.editor_on[ACTION_INPUT_CONFIRM] = [] {
-			auto matches = select_matches (false);
-			g.selection.insert (begin (matches), end (matches));
+			for (auto i : select_matches (false))
+				set_selected (g.entries[i], true);
 		};
 		break;
 	case ACTION_DESELECT:
 		g.editor = L"deselect";
 		g.editor_on_change                = [] { select_interactive (true); };
 		g.editor_on[ACTION_INPUT_CONFIRM] = [] {
-			for (const auto &match : select_matches (true))
-				g.selection.erase (match);
+			for (auto i : select_matches (true))
+				set_selected (g.entries[i], false);
 		};
 		break;
 	case ACTION_SELECT_TOGGLE:
-		if (g.selection.count (current.filename))
-			g.selection.erase (current.filename);
-		else
-			g.selection.insert (current.filename);
+		if (g.cursor >= int (g.entries.size ())) {
+			beep ();
+			break;
+		}
+		set_selected (g.entries[g.cursor], !current.selected);
 		g.cursor++;
 		break;
 	case ACTION_SELECT_ABORT:
-		g.selection.clear ();
+		selection_clear ();
 		break;
 
 	case ACTION_UP:
@@ -1669,25 +4439,39 @@ fun handle (Key k) -> bool {
 
 	case ACTION_SEARCH:
 		g.editor = L"search";
-		g.editor_on_change                = [] { match_interactive (0); };
-		g.editor_on[ACTION_UP]            = [] { match_interactive (-1); };
-		g.editor_on[ACTION_DOWN]          = [] { match_interactive (+1); };
-		g.editor_on[ACTION_INPUT_CONFIRM] = [] { enter (at_cursor ()); };
+		g.editor_on_change = [] {
+			if (g.find_mode)
+				find_restart ();
+			else
+				match_interactive (0);
+		};
+		g.editor_on[ACTION_UP]            = [] { search_move (-1); };
+		g.editor_on[ACTION_DOWN]          = [] { search_move (+1); };
+		g.editor_on[ACTION_INPUT_CONFIRM] = [] { search_enter (); };
+		g.editor_on[ACTION_INPUT_ABORT]   = [] { find_end (); };
 		g.editor_on[ACTION_ENTER]         = [] {
-			enter (at_cursor ());
+			search_enter ();
 			g.editor_line.clear ();
 			g.editor_cursor = 0;
 		};
+		g.editor_on[ACTION_FIND]          = [] {
+			if (!g.find_mode) {
+				find_begin ();
+			} else {
+				find_end ();
+				match_interactive (0);
+			}
+		};
 		break;
 	case ACTION_RENAME_PREFILL:
-		g.editor_line = to_wide (current.filename);
+		g.editor_line = to_wide (current.filename ());
 		g.editor_cursor = g.editor_line.length ();
 		// Fall-through
 	case ACTION_RENAME:
 		g.editor = L"rename";
 		g.editor_on[ACTION_INPUT_CONFIRM] = [] {
 			auto mb = to_mb (g.editor_line);
-			if (rename (at_cursor ().filename.c_str (), mb.c_str ()))
+			if (rename (at_cursor ().filename (), mb.c_str ()))
 				show_message (strerror (errno));
 			reload (true);
 		};
@@ -1704,53 +4488,393 @@ fun handle (Key k) -> bool {
 		break;
 
 	case ACTION_TOGGLE_FULL:
-		g.full_view = !g.full_view;
+		// The thin view may have been loaded with only what it needs
+		if ((g.full_view = !g.full_view) && g.partial_info)
+			reload (true);
+		break;
+	case ACTION_TOGGLE_PREVIEW:
+		g.show_preview = !g.show_preview;
 		break;
 	case ACTION_REVERSE_SORT:
 		g.reverse_sort = !g.reverse_sort;
 		resort ();
 		break;
+	case ACTION_SORT_MODE:
+		g.sort_mode = (g.sort_mode + 1) % SORT_MODES;
+		recollate ();
+		resort ();
+		show_message (string ("ordering names ") +
+			g_sort_mode_names[g.sort_mode]);
+		break;
 	case ACTION_SHOW_HIDDEN:
 		g.show_hidden = !g.show_hidden;
 		reload (true);
 		break;
 	case ACTION_REDRAW:
 		clear ();
+		invalidate ();
+		break;
+	case ACTION_TIMINGS:
+		show_message (trace_summary (), 10000);
 		break;
 	case ACTION_RELOAD:
-		reload (true);
+		reload_changes ();
+		break;
+	case ACTION_DISK_USAGE:
+		if (g.du) {
+			du_cancel ();
+			show_message ("disk usage computation cancelled");
+		} else {
+			du_start ();
+		}
 		break;
 	default:
 		if (k != KEY (RESIZE) && k != WEOF)
 			beep ();
 	}
 	fix_cursor_and_offset ();
+	if (g.loading && g.cursor != original_cursor)
+		g.load_anchor = at_cursor ().filename ();
 	update ();
 	return !g.quitting;
 }
 
+/// Pick a neighbouring directory that is worth reading in advance
+fun prefetch_candidate () -> string {
+	if (!g.prefetch_limit || !g.listings_limit || g.loading || g.find_mode
+	 || g.cwd[0] != '/')
+		return "";
+
+	vector<string> paths;
+	const auto &e = at_cursor ();
+	if (!strcmp (e.filename (), ".."))
+		paths.push_back (g.cwd.substr (0, max<size_t> (1, g.cwd.rfind ('/'))));
+	else if (S_ISDIR (e.mode) || S_ISDIR (e.target_mode))
+		paths.push_back (absolutize (g.cwd, e.filename ()));
+	if (!g.levels.empty ())
+		paths.push_back (g.levels.back ().path);
+
+	for (const auto &path : paths)
+		if (path != g.cwd && !g.prefetch_tried.count (path)
+		 && !listing_cached (path))
+			return path;
+	return "";
+}
+
+/// Start or stop prefetching as the cursor moves around, and collect results
+fun prefetch_check () {
+	if (g.prefetching && g.prefetching->finished)
+		prefetch_finish ();
+
+	auto now = monotonic_ts_ms ();
+	auto path = prefetch_candidate ();
+	if (path != g.prefetch_path) {
+		if (g.prefetching)
+			prefetch_cancel ();
+
+		// Only directories that the cursor rests on are of interest
+		g.prefetch_path = path;
+		g.prefetch_at = path.empty () ? 0 : now + 250;
+	}
+	if (!g.prefetch_at || now < g.prefetch_at || g.prefetching)
+		return;
+
+	auto job = g.prefetching = make_shared<prefetch> ();
+	job->path = path;
+	job->limit = g.prefetch_limit == SIZE_MAX ? g.entry_limit
+		: g.entry_limit ? min (g.prefetch_limit, g.entry_limit)
+		: g.prefetch_limit;
+	job->show_hidden = g.show_hidden;
+	job->options = {path, true, g.sort_mode};
+#ifdef __linux__
+	// Shared descriptors mean that the directory is already being watched
+	if ((job->wd = watch_add (path.c_str ())) != -1 && watch_in_use (job->wd))
+		job->wd = -1;
+#endif
+	g.prefetch_at = 0;
+	pool_submit ([job] {
+		prefetch_run (*job);
+		job->finished = true;
+		(void) write (g.wake_fds[1], "", 1);
+	});
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/// Run a program on a worker thread, collecting its output until there is
+/// enough of it, the deadline passes, or the job gets cancelled
+fun preview_read (const vector<const char *> &argv, const vector<string> &env,
+	int input, preview &job, int64_t deadline, size_t limit) -> string {
+	int fds[2];
+	if (pipe_cloexec (fds))
+		return "";
+
+	int null = open ("/dev/null", O_WRONLY | O_CLOEXEC);
+	auto child = spawn (argv, env, input, fds[1], null, false);
+	close (fds[1]);
+	if (null >= 0)
+		close (null);
+
+	string out;
+	char buf[BUFSIZ];
+	while (child > 0 && out.size () < limit && !job.cancelled) {
+		auto now = monotonic_ts_ms ();
+		if (now >= deadline)
+			break;
+
+		// Cancellation is only noticed this often
+		pollfd pfd = {fds[0], POLLIN, 0};
+		if (poll (&pfd, 1, min<int64_t> (deadline - now, 20)) <= 0)
+			continue;
+		auto n = read (fds[0], buf, sizeof buf);
+		if (n <= 0)
+			break;
+		out.append (buf, n);
+	}
+	close (fds[0]);
+
+	// Whatever it has started is in the same process group
+	if (child > 0) {
+		kill (-child, SIGKILL);
+		waitpid (child, nullptr, 0);
+	}
+	return out.substr (0, limit);
+}
+
+/// Have sdn-mc-ext find a View filter for a file, and run it if there is one
+fun preview_filter (preview &job, int64_t deadline, size_t limit) {
+	int config = open (job.config.c_str (), O_RDONLY | O_CLOEXEC);
+	if (config < 0)
+		return;
+
+	auto output = preview_read ({"sdn-mc-ext", "View", job.path.c_str (),
+		nullptr}, {}, config, job, deadline, 1 << 16);
+	close (config);
+
+	vector<string> fields (1);
+	for (auto c : output)
+		if (c != '\n')
+			fields.back () += c;
+		else
+			fields.emplace_back ();
+	fields.resize (5);
+
+	// Other kinds of commands are interactive programs, or worse
+	if (fields[0] != "view" || fields[1].empty ())
+		return;
+
+	int null = open ("/dev/null", O_RDONLY | O_CLOEXEC);
+	const char *pager = getenv ("PAGER");
+	job.text = preview_read ({"/bin/sh", "-c", fields[1].c_str (), nullptr},
+		{"PAGER=" + string (pager ? pager : "less"),
+		"MC_EXT_FILENAME=" + fields[2], "MC_EXT_BASENAME=" + fields[3],
+		"MC_EXT_CURRENTDIR=" + fields[4]}, null, job, deadline, limit);
+	if (null >= 0)
+		close (null);
+}
+
+/// Produce a preview on a worker thread, within limits on size and time,
+/// so that neither large files nor slow devices can hold them up
+fun preview_run (preview &job) {
+	auto deadline = monotonic_ts_ms () + 500;
+	const size_t limit = 64 << 10;
+
+	struct stat info = {};
+	if (stat (job.path.c_str (), &info)) {
+		job.note = strerror (errno);
+		return;
+	}
+
+	if (S_ISDIR (info.st_mode)) {
+		DIR *dir = opendir (job.path.c_str ());
+		if (!dir) {
+			job.note = strerror (errno);
+			return;
+		}
+
+		vector<string> names;
+		bool complete = true;
+		while (auto f = readdir (dir)) {
+			if (job.cancelled || names.size () >= 10000
+			 || monotonic_ts_ms () >= deadline) {
+				complete = false;
+				break;
+			}
+
+			string name = f->d_name;
+			if (name == "." || name == ".." || (name[0] == '.'
+			 && !job.show_hidden))
+				continue;
+			if (f->d_type == DT_DIR)
+				name += '/';
+			names.push_back (move (name));
+		}
+		closedir (dir);
+
+		sort (names.begin (), names.end ());
+		for (const auto &name : names)
+			if (job.text.size () < limit)
+				job.text.append (name).append ("\n");
+		if (!complete)
+			job.text.append ("...\n");
+		else if (names.empty ())
+			job.note = "empty directory";
+		return;
+	}
+
+	// Reading from pipes or devices could block, or have side effects
+	if (!S_ISREG (info.st_mode)) {
+		job.note = "special file";
+		return;
+	}
+	if (!info.st_size) {
+		job.note = "empty file";
+		return;
+	}
+
+	int fd = open (job.path.c_str (), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		job.note = strerror (errno);
+		return;
+	}
+	job.text.resize (min<off_t> (limit, info.st_size));
+	size_t got = 0;
+	while (got < job.text.size () && !job.cancelled) {
+		auto n = read (fd, &job.text[got], job.text.size () - got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		got += n;
+	}
+	close (fd);
+	job.text.resize (got);
+
+	// Text is shown as it is, anything else needs to be converted
+	if (job.text.find ('\0') == string::npos)
+		return;
+	job.text.clear ();
+	if (!job.config.empty ())
+		preview_filter (job, deadline, limit);
+	if (job.text.empty ())
+		job.note = "binary data";
+}
+
+/// Start or stop producing a preview as the cursor moves around,
+/// and collect results
+fun preview_check () {
+	if (g.previewing && g.previewing->finished) {
+		g.previews.push_front (move (g.previewing));
+		if (g.previews.size () > 16)
+			g.previews.pop_back ();
+		update ();
+	}
+
+	const entry *e = nullptr;
+	if (g.show_preview && !g.view.data && !g.entries.empty ())
+		e = &at_cursor ();
+	if (g.previewing && (!e || !preview_matches (*g.previewing, *e))) {
+		g.previewing->cancelled = true;
+		g.previewing.reset ();
+	}
+
+	auto now = monotonic_ts_ms ();
+	auto path = e && !e->failed && !preview_of (*e)
+		? absolutize (g.cwd, e->filename ()) : "";
+	if (path != g.preview_path) {
+		// Only entries that the cursor rests on are of interest
+		g.preview_path = path;
+		g.preview_at = path.empty () ? 0 : now + 50;
+	}
+	if (!g.preview_at || now < g.preview_at || g.previewing)
+		return;
+
+	auto job = g.previewing = make_shared<preview> ();
+	job->cwd = g.cwd;
+	job->name = e->filename ();
+	job->path = path;
+	job->dev = e->dev;
+	job->ino = e->ino;
+	job->mtime = e->mtime;
+	job->show_hidden = g.show_hidden;
+	job->config = mc_ext_config ();
+	g.preview_at = 0;
+	pool_submit ([job] {
+		preview_run (*job);
+		job->finished = true;
+		(void) write (g.wake_fds[1], "", 1);
+	});
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 fun watch_check () {
 	bool changed = false;
-	// Only provide simple indication that contents might have changed,
-	// if only because kqueue can't do any better
 #ifdef __linux__
-	char buf[4096]; ssize_t len;
+	// Remember the names so that reload_changes() can do just the minimum
+	alignas (inotify_event) char buf[4096]; ssize_t len;
 	while ((len = read (g.watch_fd, buf, sizeof buf)) > 0) {
 		const inotify_event *e;
 		for (char *ptr = buf; ptr < buf + len; ptr += sizeof *e + e->len) {
 			e = (const inotify_event *) ptr;
-			if (e->wd == g.watch_wd)
-				changed = true;
+			if (e->mask & IN_Q_OVERFLOW)
+				g.out_of_sync = changed = true;
+			if (g.prefetching && e->wd == g.prefetching->wd)
+				g.prefetching->dirty = true;
+			if (e->wd != g.watch_wd) {
+				listing_invalidate (e->wd);
+				continue;
+			}
+
+			if (e->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT))
+				g.out_of_sync = changed = true;
+			else if (e->len)
+				g.changed.insert (e->name), changed = true;
 		}
 	}
 #elif !defined __CYGWIN__
+	// Only provide simple indication that contents might have changed,
+	// because kqueue can't do any better
 	struct kevent ev {};
 	struct timespec timeout {};
-	if (kevent (g.watch_fd, nullptr, 0, &ev, 1, &timeout) > 0)
-		changed = ev.filter == EVFILT_VNODE && (ev.fflags & NOTE_WRITE);
+	if (kevent (g.watch_fd, nullptr, 0, &ev, 1, &timeout) > 0
+	 && ev.filter == EVFILT_VNODE && (ev.fflags & NOTE_WRITE))
+		g.out_of_sync = changed = true;
 #endif
-	if ((g.out_of_date = changed))
-		update ();
+	// Names merge within the set, announcements are rate-limited
+	if (changed)
+		g.watch_pending = true;
+}
+
+/// Return when pending file watch events are to be announced, or 0
+fun watch_deadline () -> int64_t {
+	// Keep automatic refreshes, in particular full ones, from taking up
+	// more than about a quarter of the time on constantly changing directories
+	return g.watch_pending
+		? g.watch_last + max<int64_t> (g.watch_interval, g.watch_cost * 4)
+		: 0;
+}
+
+fun watch_announce () {
+	g.watch_pending = false;
+	g.watch_last = monotonic_ts_ms ();
+
+	// Past a certain point, reading everything anew is the cheaper option
+	if (g.changed.size () > g.watch_limit) {
+		g.changed.clear ();
+		g.out_of_sync = true;
+	}
+	g.out_of_date = true;
+
+	// This keeps the cursor, selection and scroll offset, and won't block
+	// for long even when it needs to read the whole directory
+	if (g.auto_reload && !g.find_mode) {
+		reload_changes ();
+		fix_cursor_and_offset ();
+		if (!(g.watch_refreshing = g.loading))
+			g.watch_cost = monotonic_ts_ms () - g.watch_last;
+	}
+	update ();
 }
 
 fun load_cmdline (int argc, char *argv[]) {
@@ -1823,8 +4947,8 @@ fun load_ls_colors (vector<string> colors) {
 			g.ls_colors[i] = m->second;
 	}
 	for (const auto &pair : attrs) {
-		if (pair.first.substr (0, 2) == "*.")
-			g.ls_exts[pair.first.substr (2)] = pair.second;
+		if (pair.first.length () > 1 && pair.first[0] == '*')
+			g.ls_suffixes.insert (pair.first.substr (1), pair.second);
 	}
 }
 
@@ -1850,29 +4974,17 @@ fun load_colors () {
 	}
 }
 
-fun monotonic_ts_ms () -> int64_t {
-	timespec ts{1, 0};  // A very specific fail-safe value
-	(void) clock_gettime (CLOCK_MONOTONIC, &ts);
-	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+fun input_pending () -> bool {
+	pollfd pfd {STDIN_FILENO, POLLIN, 0};
+	return poll (&pfd, 1, 0) > 0;
 }
 
+/// Read a key without blocking, returning false if there's none pending
 fun read_key (Key &k) -> bool {
-	// XXX: on at least some systems, when run over ssh in a bind handler,
-	// after closing the terminal emulator we receive no fatal signal but our
-	// parent shell gets reparented under init and our stdin gets closed,
-	// so we'd keep getting ERR in an infinite loop, as that is what ncurses
-	// automatically converts EOF into.  The most reasonable way to detect this
-	// situation appears to be via timing.  Checking errno doesn't work and
-	// resetting signal dispositions or the signal mask has no effect.
-	auto start = monotonic_ts_ms ();
-
 	wint_t c{};
 	int res = get_wch (&c);
-	if (res == ERR) {
-		c = WEOF;
-		if (monotonic_ts_ms () - start >= 50)
-			return false;
-	}
+	if (res == ERR)
+		return false;
 	k = c;
 
 	wint_t metafied{};
@@ -1993,14 +5105,29 @@ fun load_bindings () {
 	}
 }
 
+/// Take in navigation state from older versions, which kept it in the config
 fun load_history_level (const vector<string> &v) {
 	if (v.size () < 7)
 		return;
-	// Not checking the hostname and parent PID right now since we can't merge
 	g.levels.push_back ({stoi (v.at (4)), stoi (v.at (5)), v.at (3), v.at (6),
 		set<string> (begin (v) + 7, end (v))});
 }
 
+fun load_sort_mode (const string &name) {
+	for (int i = 0; i < SORT_MODES; i++)
+		if (name == g_sort_mode_names[i])
+			g.sort_mode = i;
+}
+
+fun load_prefetch (const string &limit) {
+	if (limit == "off")
+		g.prefetch_limit = 0;
+	else if (limit == "always")
+		g.prefetch_limit = SIZE_MAX;
+	else
+		g.prefetch_limit = max<size_t> (1, stoul (limit));
+}
+
 fun load_config () {
 	auto config = xdg_config_find ("config");
 	if (!config)
@@ -2021,13 +5148,301 @@ fun load_config () {
 			g.show_hidden  = tokens.at (1) == "1";
 		else if (tokens.front () == "ext-helpers"  && tokens.size () > 1)
 			g.ext_helpers  = tokens.at (1) == "1";
+		else if (tokens.front () == "auto-reload"  && tokens.size () > 1)
+			g.auto_reload  = tokens.at (1) == "1";
 		else if (tokens.front () == "sort-column"  && tokens.size () > 1)
 			g.sort_column  = stoi (tokens.at (1));
+		else if (tokens.front () == "sort-mode"    && tokens.size () > 1)
+			load_sort_mode (tokens.at (1));
+		else if (tokens.front () == "watch-interval" && tokens.size () > 1)
+			g.watch_interval = max (0, stoi (tokens.at (1)));
+		else if (tokens.front () == "watch-limit"  && tokens.size () > 1)
+			g.watch_limit = stoul (tokens.at (1));
+		else if (tokens.front () == "cache-size"   && tokens.size () > 1)
+			g.listings_limit = stoul (tokens.at (1)) << 20;
+		else if (tokens.front () == "prefetch"     && tokens.size () > 1)
+			load_prefetch (tokens.at (1));
+		else if (tokens.front () == "entry-limit"  && tokens.size () > 1)
+			g.entry_limit = stoul (tokens.at (1));
+		else if (tokens.front () == "find-depth"   && tokens.size () > 1)
+			g.find_depth = stoul (tokens.at (1));
+		else if (tokens.front () == "find-xdev"    && tokens.size () > 1)
+			g.find_xdev = tokens.at (1) == "1";
+		else if (tokens.front () == "preview"      && tokens.size () > 1)
+			g.show_preview = tokens.at (1) == "1";
+		else if (tokens.front () == "no-xattrs")
+			g.no_xattrs.assign (begin (tokens) + 1, end (tokens));
 		else if (tokens.front () == "history")
 			load_history_level (tokens);
 	}
 }
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+// Navigation state is kept for each shell session separately, in a file
+// consisting of length-prefixed strings that can be skipped over quickly.
+// Sessions append their records, the last one for each session counts,
+// and only the levels of the session that we belong to get decoded.
+
+static const char g_history_header[] = "sdn-history 1\n";
+
+fun history_path () -> string {
+	return xdg_state_home () + "/" PROJECT_NAME "/history";
+}
+
+/// Identify the shell session that we're running in
+fun history_key () -> string {
+	char hostname[256];
+	if (gethostname (hostname, sizeof hostname))
+		*hostname = 0;
+	hostname[sizeof hostname - 1] = 0;
+	return string (hostname) + '\0' + to_string (getppid ());
+}
+
+fun history_write_string (string &out, const string &s) {
+	out.append (to_string (s.length ())).append (1, ' ').append (s);
+}
+
+/// Find a string in place, advancing past it, unless the data is damaged
+fun history_scan (const char *&p, const char *end,
+	const char *&s, size_t &length) -> bool {
+	auto q = p;
+	length = 0;
+	for (; q < end && *q >= '0' && *q <= '9'; q++) {
+		if (length > (SIZE_MAX - 9) / 10)
+			return false;
+		length = length * 10 + (*q - '0');
+	}
+	if (q == p || q == end || *q++ != ' ' || length > size_t (end - q))
+		return false;
+	s = q;
+	p = q + length;
+	return true;
+}
+
+fun history_read_string (const string &in, size_t &pos, string &s) -> bool {
+	auto p = in.data () + pos;
+	const char *value = nullptr;
+	size_t length = 0;
+	if (!history_scan (p, in.data () + in.length (), value, length))
+		return false;
+	s.assign (value, length);
+	pos = p - in.data ();
+	return true;
+}
+
+/// A session's record within a mapped store
+struct history_record {
+	const char *key; size_t key_length;
+	const char *data; size_t data_length;
+};
+
+/// Go through all intact records of a mapped store, oldest first,
+/// and return whether there has been no damage to stop at
+fun history_scan_records (const char *p, const char *end,
+	const function<void (const history_record &)> &f) -> bool {
+	auto header = sizeof g_history_header - 1;
+	if (size_t (end - p) < header || memcmp (p, g_history_header, header))
+		return false;
+
+	history_record r {};
+	for (p += header; p < end; f (r))
+		if (!history_scan (p, end, r.key, r.key_length)
+		 || !history_scan (p, end, r.data, r.data_length))
+			return false;
+	return true;
+}
+
+/// Map the store into memory, so that records may be skipped without copying
+fun history_map (int fd, size_t &size) -> const char * {
+	struct stat info = {};
+	if (fd < 0 || fstat (fd, &info) || info.st_size <= 0) {
+		size = 0;
+		return nullptr;
+	}
+	auto data = mmap (nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	size = info.st_size;
+	return data == MAP_FAILED ? nullptr : (const char *) data;
+}
+
+/// Restore the levels of our shell session, or failing that,
+/// of the last session on this machine
+fun load_history () {
+	auto key = history_key ();
+	auto host = key.substr (0, key.find ('\0') + 1);
+
+	int fd = open (history_path ().c_str (), O_RDONLY | O_CLOEXEC);
+	size_t size = 0;
+	auto mapped = history_map (fd, size);
+	if (fd >= 0)
+		close (fd);
+	if (!mapped)
+		return;
+
+	const char *found = nullptr;
+	size_t found_length = 0;
+	bool exact = false;
+	g.history_damaged = !history_scan_records (mapped, mapped + size,
+		[&](const history_record &r) {
+			bool same = r.key_length == key.length ()
+				&& !memcmp (r.key, key.data (), key.length ());
+			if (same || (!exact && r.key_length >= host.length ()
+			 && !memcmp (r.key, host.data (), host.length ())))
+				found = r.data, found_length = r.data_length, exact |= same;
+		});
+	string data (found ? found : "", found_length);
+	munmap ((void *) mapped, size);
+	if (data.empty ())
+		return;
+
+	vector<level> levels;
+	string offset, cursor, count, name;
+	for (size_t pos = 0; pos < data.length (); ) {
+		level l {};
+		if (!history_read_string (data, pos, l.path)
+		 || !history_read_string (data, pos, l.filename)
+		 || !history_read_string (data, pos, offset)
+		 || !history_read_string (data, pos, cursor)
+		 || !history_read_string (data, pos, count))
+			return;
+
+		l.offset = atoi (offset.c_str ());
+		l.cursor = atoi (cursor.c_str ());
+		for (auto n = strtoul (count.c_str (), nullptr, 10); n--; ) {
+			if (!history_read_string (data, pos, name))
+				return;
+			l.selection.insert (l.selection.end (), name);
+		}
+		levels.push_back (move (l));
+	}
+	g.levels = move (levels);
+}
+
+/// Replace the store as a whole, so that it never ends up truncated
+fun history_replace (const string &path, const string &contents) {
+	string temporary = path + ".XXXXXX";
+	int fd = mkstemp (&temporary[0]);
+	if (fd < 0)
+		return;
+	close (fd);
+
+	ofstream out (temporary, ios::binary | ios::trunc);
+	out << contents;
+	out.close ();
+	if (!out || rename (temporary.c_str (), path.c_str ()))
+		unlink (temporary.c_str ());
+}
+
+/// Keep only the last record of the most recent sessions, as long as they
+/// fit within half of the limit, making room for records to be appended
+fun history_compact (const string &path, int fd, size_t limit) {
+	size_t size = 0;
+	auto mapped = history_map (fd, size);
+	if (!mapped)
+		return;
+
+	vector<history_record> records;
+	history_scan_records (mapped, mapped + size,
+		[&](const history_record &r) { records.push_back (r); });
+
+	// Walk back from the most recent record, which is always kept
+	const size_t sessions = 64;
+	set<string> seen;
+	vector<const history_record *> kept;
+	size_t used = 0;
+	for (auto i = records.rbegin ();
+		i != records.rend () && kept.size () < sessions; i++) {
+		if (!seen.insert (string (i->key, i->key_length)).second)
+			continue;
+		auto cost = i->key_length + i->data_length + 40;
+		if (!kept.empty () && used + cost > limit / 2)
+			break;
+		used += cost;
+		kept.push_back (&*i);
+	}
+
+	string contents = g_history_header;
+	for (auto i = kept.rbegin (); i != kept.rend (); i++) {
+		history_write_string (contents, string ((*i)->key, (*i)->key_length));
+		history_write_string (contents,
+			string ((*i)->data, (*i)->data_length));
+	}
+	munmap ((void *) mapped, size);
+	history_replace (path, contents);
+}
+
+/// Append a record of our shell session's levels, which supersedes any
+/// earlier ones, and compact the store once it grows too large
+fun save_history () {
+	string data;
+	auto add = [&](const level &l) {
+		history_write_string (data, l.path);
+		history_write_string (data, l.filename);
+		history_write_string (data, to_string (l.offset));
+		history_write_string (data, to_string (l.cursor));
+		history_write_string (data, to_string (l.selection.size ()));
+		for (const auto &name : l.selection)
+			history_write_string (data, name);
+	};
+	for (const auto &l : g.levels)
+		add (l);
+	add ({g.offset, g.cursor, g.cwd, at_cursor ().filename (),
+		selection_names ()});
+
+	string record;
+	history_write_string (record, history_key ());
+	history_write_string (record, data);
+
+	auto path = history_path ();
+	for (auto slash = path.find ('/', 1); slash != path.npos;
+		slash = path.find ('/', slash + 1))
+		(void) mkdir (path.substr (0, slash).c_str (), 0755);
+
+	// Compaction replaces the store, so it can't be locked itself
+	int lock = open ((path + ".lock").c_str (),
+		O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lock < 0 || flock (lock, LOCK_EX)) {
+		if (lock >= 0)
+			close (lock);
+		return;
+	}
+
+	// Records appended after any damage would never be found
+	const size_t limit = 4 << 20;
+	if (g.history_damaged) {
+		int damaged = open (path.c_str (), O_RDONLY | O_CLOEXEC);
+		if (damaged >= 0) {
+			history_compact (path, damaged, limit);
+			close (damaged);
+		}
+	}
+
+	int fd = open (path.c_str (),
+		O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	struct stat info = {};
+	char header[sizeof g_history_header - 1] = {};
+	if (fd < 0 || fstat (fd, &info)) {
+		// Nothing we could do about it
+	} else if (info.st_size && (pread (fd, header, sizeof header, 0)
+		!= ssize_t (sizeof header)
+		|| memcmp (header, g_history_header, sizeof header))) {
+		history_replace (path, g_history_header + record);
+	} else {
+		if (!info.st_size)
+			record = g_history_header + record;
+
+		// Don't leave a partial record behind, or later ones would be lost
+		if (write (fd, record.data (), record.length ())
+			!= ssize_t (record.length ()))
+			(void) ftruncate (fd, info.st_size);
+		else if (info.st_size + record.length () > limit)
+			history_compact (path, fd, limit);
+	}
+	if (fd >= 0)
+		close (fd);
+	close (lock);
+}
+
 fun save_config () {
 	auto config = xdg_config_write ("config");
 	if (!config)
@@ -2038,24 +5453,230 @@ fun save_config () {
 	write_line (*config, {"reverse-sort", g.reverse_sort ? "1" : "0"});
 	write_line (*config, {"show-hidden",  g.show_hidden  ? "1" : "0"});
 	write_line (*config, {"ext-helpers",  g.ext_helpers  ? "1" : "0"});
+	write_line (*config, {"auto-reload",  g.auto_reload  ? "1" : "0"});
 
 	write_line (*config, {"sort-column",  to_string (g.sort_column)});
+	write_line (*config, {"sort-mode",    g_sort_mode_names[g.sort_mode]});
+	write_line (*config, {"watch-interval", to_string (g.watch_interval)});
+	write_line (*config, {"watch-limit",  to_string (g.watch_limit)});
+	write_line (*config, {"cache-size",   to_string (g.listings_limit >> 20)});
+	write_line (*config, {"prefetch",     !g.prefetch_limit ? "off"
+		: g.prefetch_limit == SIZE_MAX ? "always"
+		: to_string (g.prefetch_limit)});
+	write_line (*config, {"entry-limit",  to_string (g.entry_limit)});
+	write_line (*config, {"find-depth",   to_string (g.find_depth)});
+	write_line (*config, {"find-xdev",    g.find_xdev ? "1" : "0"});
+	write_line (*config, {"preview",      g.show_preview ? "1" : "0"});
+
+	vector<string> no_xattrs {"no-xattrs"};
+	no_xattrs.insert (end (no_xattrs), begin (g.no_xattrs), end (g.no_xattrs));
+	if (!g.no_xattrs.empty ())
+		write_line (*config, no_xattrs);
+}
 
-	char hostname[256];
-	if (gethostname (hostname, sizeof hostname))
-		*hostname = 0;
+fun load_locale () {
+	try {
+		// Under MSYS2, the C++ locale mechanism cannot load UTF-8 this way.
+		locale::global (locale (""));
+	} catch (const runtime_error &) {
+		setlocale (LC_CTYPE, "");
+		setlocale (LC_COLLATE, "");
+	}
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+/// Resource usage at some point, for measuring phases of a benchmark
+struct bench_sample {
+	double wall, user, sys;             ///< Times in milliseconds
+	long switches;                      ///< Voluntary context switches
+	long long syscalls = -1;            ///< read() and write() calls, if known
+	long peak_rss;                      ///< Peak resident set size in KiB
+};
+
+fun bench_take () -> bench_sample {
+	bench_sample s;
+	timespec ts {};
+	(void) clock_gettime (CLOCK_MONOTONIC, &ts);
+	s.wall = ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+
+	rusage usage {};
+	(void) getrusage (RUSAGE_SELF, &usage);
+	s.user = usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3;
+	s.sys = usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3;
+	s.switches = usage.ru_nvcsw;
+	s.peak_rss = usage.ru_maxrss;
+
+	// Linux doesn't count other system calls anywhere we could read
+	ifstream io ("/proc/self/io");
+	string key; long long value;
+	while (io >> key >> value)
+		if (key == "syscr:" || key == "syscw:")
+			s.syscalls = max (0LL, s.syscalls) + value;
+	return s;
+}
+
+/// Run and measure one phase of a benchmark, printing out a result line
+fun bench_phase (const string &name, const function<void ()> &f) {
+	auto before = bench_take ();
+	f ();
+	auto after = bench_take ();
+
+	char line[128];
+	snprintf (line, sizeof line, "%-20s %10.1f %10.1f %10.1f %8ld %10s %8ld",
+		name.c_str (), after.wall - before.wall, after.user - before.user,
+		after.sys - before.sys, after.switches - before.switches,
+		after.syscalls < 0 ? "-"
+			: to_string (after.syscalls - before.syscalls).c_str (),
+		after.peak_rss);
+	cout << line << endl;
+}
+
+/// Measure the listing pipeline on a directory, without a terminal
+fun bench (const char *dir) -> int {
+	if (chdir (dir)) {
+		cerr << dir << ": " << strerror (errno) << endl;
+		return 1;
+	}
+#ifdef __linux__
+	g.watch_fd = inotify_init1 (IN_NONBLOCK);
+#elif !defined __CYGWIN__
+	g.watch_fd = kqueue ();
+#endif
+	load_locale ();
+
+	// Draw into the void, at a fixed size, so that results are comparable
+	FILE *null = fopen ("/dev/null", "r+");
+	const char *term = getenv ("TERM");
+	if (!null || !newterm (term && *term ? term : "xterm", null, null)) {
+		cerr << "cannot initialize screen" << endl;
+		return 1;
+	}
+	resizeterm (50, 160);
+	load_colors ();
+
+	g.cwd = initial_cwd ();
+	g.full_view = true;
+	g.listings_limit = 0;
+
+	char header[128];
+	snprintf (header, sizeof header, "%-20s %10s %10s %10s %8s %10s %8s",
+		"phase", "wall ms", "user ms", "sys ms", "switches", "rw calls",
+		"peak KiB");
+	cout << header << endl;
+	bench_phase ("reload", [] {
+		reload (false);
+		while (g.loading)
+			reload_step (256);
+	});
+
+	static const char *names[entry::COLUMNS] =
+		{"modes", "user", "group", "size", "mtime", "filename"};
+	for (int col = 0; col < entry::COLUMNS; col++) {
+		g.sort_column = col;
+		bench_phase (string ("resort by ") + names[col], [] { resort (); });
+	}
+
+	// Pick names from all over the listing, their prefixes act as needles
+	vector<wstring> needles;
+	for (size_t i = 0; i < 100 && !g.entries.empty (); i++)
+		needles.push_back (to_wide (g.entries[i * 7919 % g.entries.size ()]
+			.filename ()));
+	// Right after a reload, the name index hasn't been built yet
+	bench_phase ("focus unindexed", [&] {
+		for (const auto &needle : needles)
+			focus (to_mb (needle));
+	});
+	bench_phase ("lookup", [&] {
+		for (const auto &needle : needles)
+			for (size_t n = 1; n <= needle.length (); n++)
+				lookup (needle.substr (0, n));
+	});
+	bench_phase ("focus", [&] {
+		for (int i = 0; i < 100; i++)
+			for (const auto &needle : needles)
+				focus (to_mb (needle));
+	});
+	bench_phase ("match", [&] {
+		for (const auto &needle : needles)
+			for (size_t n = 1; n <= needle.length (); n++)
+				match (needle.substr (0, n), 0);
+	});
+
+	g.cursor = g.offset = 0;
+	bench_phase ("draw cursor moves", [] {
+		for (int i = 0; i < 1000; i++) {
+			g.cursor++;
+			fix_cursor_and_offset ();
+			update ();
+		}
+	});
+	bench_phase ("draw full redraws", [] {
+		for (int i = 0; i < 100; i++) {
+			g.cursor += visible_lines ();
+			fix_cursor_and_offset ();
+			invalidate ();
+			update ();
+		}
+	});
+
+	endwin ();
+	pool_stop ();
+	trace_save ();
+	return 0;
+}
+
+/// Create a synthetic directory tree for benchmarking, with the given number
+/// of entries in its root, and a few more in subdirectories
+fun bench_tree (const char *dir, unsigned long long count) -> int {
+	if (mkdir (dir, 0755) && errno != EEXIST) {
+		cerr << dir << ": " << strerror (errno) << endl;
+		return 1;
+	}
 
-	auto ppid = std::to_string (getppid ());
-	for (auto i = g.levels.begin (); i != g.levels.end (); i++) {
-		vector<string> line {"history", hostname, ppid, i->path,
-			to_string (i->offset), to_string (i->cursor), i->filename};
-		line.insert (end (line), begin (i->selection), end (i->selection));
-		write_line (*config, line);
+	// It is important that the tree is the same every time
+	uint32_t seed = 1;
+	auto random = [&] { return (seed = seed * 1103515245 + 12345) >> 16; };
+	static const char *words[] = {"report", "IMG_", "Příliš žluťoučký kůň",
+		"ďábelské ódy", "日本語のファイル", "backup", "README", "data"};
+	static const char *suffixes[] =
+		{".txt", ".tar.gz", ".jpg", ".c", "", ".pdf"};
+	auto pick = [&](const char **v, size_t n) { return v[random () % n]; };
+
+	// Valid links lead to whatever has been created before them
+	vector<string> created;
+	for (unsigned long long i = 0; i < count; i++) {
+		auto kind = random () % 100;
+		string name = pick (words, sizeof words / sizeof *words)
+			+ to_string (i);
+		while (kind < 5 && name.length () < 200)
+			name += words[2];
+		auto path = string (dir) + "/" + name;
+
+		if (kind < 10) {
+			if (!mkdir (path.c_str (), 0755))
+				created.push_back (name);
+			if (kind < 2)
+				for (int k = 0; k < 10; k++)
+					close (creat ((path + "/" + to_string (k)).c_str (), 0644));
+		} else if (kind < 15) {
+			// Some of the links lead nowhere
+			auto target = kind < 12 || created.empty ()
+				? "missing" + to_string (i)
+				: created[random () % created.size ()];
+			(void) symlink (target.c_str (), path.c_str ());
+		} else {
+			name += pick (suffixes, sizeof suffixes / sizeof *suffixes);
+			int fd = creat ((path = string (dir) + "/" + name).c_str (),
+				kind < 20 ? 0755 : 0644);
+			if (fd >= 0) {
+				created.push_back (name);
+				(void) ftruncate (fd, random () % (1 << 20));
+				close (fd);
+			}
+		}
 	}
-	vector<string> line {"history", hostname, ppid, g.cwd,
-		to_string (g.offset), to_string (g.cursor), at_cursor ().filename};
-	line.insert (end (line), begin (g.selection), end (g.selection));
-	write_line (*config, line);
+	return 0;
 }
 
 int main (int argc, char *argv[]) {
@@ -2063,6 +5684,14 @@ int main (int argc, char *argv[]) {
 		cout << PROJECT_NAME << " " << PROJECT_VERSION << endl;
 		return 0;
 	}
+#ifndef NO_TRACING
+	if (const char *trace = getenv ("SDN_TRACE"))
+		g_trace.path = trace;
+#endif
+	if (argc == 3 && string (argv[1]) == "--bench")
+		return bench (argv[2]);
+	if (argc == 4 && string (argv[1]) == "--bench-tree")
+		return bench_tree (argv[2], strtoull (argv[3], nullptr, 10));
 
 	// zsh before 5.4 may close stdin before exec without redirection,
 	// since then it redirects stdin to /dev/null
@@ -2078,6 +5707,14 @@ int main (int argc, char *argv[]) {
 
 	// So that the neither us nor our children stop on tcsetpgrp()
 	signal (SIGTTOU, SIG_IGN);
+	// The sdn-mc-ext process may go away, we can cope
+	signal (SIGPIPE, SIG_IGN);
+
+	struct sigaction sa = {};
+	sa.sa_sigaction = viewer_sigbus;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset (&sa.sa_mask);
+	sigaction (SIGBUS, &sa, nullptr);
 
 #ifdef __linux__
 	if ((g.watch_fd = inotify_init1 (IN_NONBLOCK)) < 0) {
@@ -2091,20 +5728,29 @@ int main (int argc, char *argv[]) {
 	}
 #endif
 
-	try {
-		// Under MSYS2, the C++ locale mechanism cannot load UTF-8 this way.
-		locale::global (locale (""));
-	} catch (const runtime_error &) {
-		setlocale (LC_CTYPE, "");
+	// Worker threads need a way of interrupting poll() in the main loop
+	if (pipe (g.wake_fds)) {
+		cerr << "cannot create a pipe" << endl;
+		return 1;
 	}
+	for (auto fd : g.wake_fds)
+		fcntl (fd, F_SETFL, O_NONBLOCK), fcntl (fd, F_SETFD, FD_CLOEXEC);
 
+	load_locale ();
 	load_bindings ();
 	load_config ();
+	load_history ();
+#ifdef __linux__
+	for (const auto &path : g.no_xattrs)
+		xattrs_skip (path);
+#endif
 
 	if (!initscr () || cbreak () == ERR || noecho () == ERR || nonl () == ERR) {
 		cerr << "cannot initialize screen" << endl;
 		return 1;
 	}
+	// Let ncurses scroll the terminal rather than repaint it when possible
+	idlok (stdscr, TRUE);
 	for (const auto &definition_kc : g.custom_keys)
 		define_key (definition_kc.first.c_str (), definition_kc.second);
 
@@ -2117,31 +5763,119 @@ int main (int argc, char *argv[]) {
 
 	// Cunt, now I need to reïmplement all signal handling
 #if NCURSES_VERSION_PATCH < 20210821
-	// This gets applied along with the following halfdelay()
+	// This gets applied along with the following cbreak()
 	cur_term->Nttyb.c_cc[VSTOP] =
 		cur_term->Nttyb.c_cc[VSTART] = _POSIX_VDISABLE;
 #endif
 
 	// Invoking keypad() earlier would make ncurses flush its output buffer,
 	// which would worsen start-up flickering
-	if (halfdelay (1) == ERR || keypad (stdscr, TRUE) == ERR) {
+	if (cbreak () == ERR || nodelay (stdscr, TRUE) == ERR
+	 || keypad (stdscr, TRUE) == ERR) {
 		endwin ();
 		cerr << "cannot configure input" << endl;
 		return 1;
 	}
 
-	Key k;
-	while (!read_key (k) || handle (k)) {
-		watch_check ();
-		if (g.sort_flash_ttl && !--g.sort_flash_ttl)
-			update ();
-		if (g.message_ttl && !--g.message_ttl) {
+	// Sleep until there is something to do, as there may be many instances
+	// of the program idling in the background
+	int stray_wakeups = 0;
+	auto last_paint = monotonic_ts_ms ();
+	while (!g.quitting) {
+		prefetch_check ();
+		preview_check ();
+
+		auto now = monotonic_ts_ms ();
+		int64_t deadline = -1;
+		for (auto until : {g.sort_flash_until, g.message_until,
+			watch_deadline (), g.prefetch_at, g.preview_at, g.du_progress_at,
+			g.du_expire_at, g.find_check_at})
+			if (until && (deadline < 0 || until < deadline))
+				deadline = until;
+
+		// Keep reading the directory for as long as the user is idle
+		int timeout = deadline < 0 ? -1 : max<int64_t> (0, deadline - now);
+		if (g.loading)
+			timeout = 0;
+
+		pollfd pfds[] = {{STDIN_FILENO, POLLIN, 0}, {g.watch_fd, POLLIN, 0},
+			{g.wake_fds[0], POLLIN, 0}};
+		if (poll (pfds, 3, timeout) < 0 && errno != EINTR)
+			break;
+
+		// XXX: on at least some systems, when run over ssh in a bind handler,
+		// after closing the terminal emulator we receive no fatal signal but
+		// our parent shell gets reparented under init and our stdin gets
+		// closed, so it keeps polling readable, yet ncurses only returns ERR.
+		// Signals such as SIGWINCH also need to be processed here, so that
+		// ncurses can produce KEY_RESIZE.
+		Key k;
+		bool any = false;
+		while (!g.quitting && read_key (k)) {
+			any = true;
+			if (!handle (k))
+				g.quitting = true;
+		}
+		if (pfds[0].revents & (POLLHUP | POLLERR | POLLNVAL))
+			break;
+		if (!any && (pfds[0].revents & POLLIN) && ++stray_wakeups >= 10)
+			break;
+		if (any)
+			stray_wakeups = 0;
+
+		if (pfds[1].revents)
+			watch_check ();
+
+		char drain[64];
+		if (pfds[2].revents)
+			while (read (g.wake_fds[0], drain, sizeof drain) > 0)
+				;
+
+		now = monotonic_ts_ms ();
+		bool expired = false;
+		// Restarting an automatic reload might make it never finish
+		if (g.watch_pending && now >= watch_deadline ()
+		 && !(g.auto_reload && g.loading))
+			watch_announce ();
+		if (g.sort_flash_until && now >= g.sort_flash_until)
+			g.sort_flash_until = 0, expired = true;
+		if (g.message_until && now >= g.message_until) {
 			g.message.clear ();
+			g.message_until = 0, expired = true;
+		}
+		if (expired)
 			update ();
+
+		if (g.du)
+			du_check ();
+		if (g.du_expire_at && now >= g.du_expire_at)
+			du_expire ();
+		if (g.finding && (g.finding->finished || now >= g.find_check_at))
+			find_check ();
+		if (g.loading && !input_pending ()) {
+			reload_step (256);
+			if (!g.loading || monotonic_ts_ms () - last_paint >= 100) {
+				fix_cursor_and_offset ();
+				update ();
+				last_paint = monotonic_ts_ms ();
+			}
 		}
 	}
 	endwin ();
+	if (g.prefetching)
+		prefetch_cancel ();
+	if (g.previewing)
+		g.previewing->cancelled = true;
+	if (g.du)
+		du_cancel ();
+	if (g.finding)
+		walk_cancel (*g.finding);
+	pool_stop ();
+	if (g.mc_ext_pid > 0)
+		mc_ext_stop ();
 	save_config ();
+	save_history ();
+	trace_save ();
 
 	// Presumably it is going to end up as an argument, so quote it
 	string chosen;